@@ -0,0 +1,121 @@
+#include <zpp_bits.h>
+#include <zpp_proto.h>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+struct ordered_phones
+{
+    std::map<std::string, std::uint64_t> phones; // = 1
+};
+
+struct hashed_phones
+{
+    std::unordered_map<std::string, std::uint64_t> phones; // = 1
+};
+
+template <typename Message>
+void round_trip(const char *name, std::size_t entries, int iterations)
+{
+    Message original;
+    for (std::size_t i = 0; i < entries; ++i) {
+        original.phones.emplace("555-" + std::to_string(i), i);
+    }
+
+    std::vector<std::byte> data;
+    auto encode_time = std::chrono::steady_clock::duration{};
+    auto decode_time = std::chrono::steady_clock::duration{};
+    for (int i = 0; i < iterations; ++i) {
+        data.clear();
+        auto start = std::chrono::steady_clock::now();
+        zpp::proto::out{data}(original).or_throw();
+        auto encoded = std::chrono::steady_clock::now();
+
+        Message decoded;
+        zpp::proto::in{data}(decoded).or_throw();
+        auto decoded_end = std::chrono::steady_clock::now();
+
+        if (decoded.phones.size() != entries) {
+            std::fprintf(stderr, "%s: round trip mismatch\n", name);
+            std::exit(1);
+        }
+        encode_time += encoded - start;
+        decode_time += decoded_end - encoded;
+    }
+
+    auto per_iteration = [&](auto duration) {
+        return std::chrono::duration<double, std::milli>(duration).count() /
+               iterations;
+    };
+    std::printf("%-14s %8zu entries %10zu bytes  encode %8.3f ms  decode "
+                "%8.3f ms\n",
+                name, entries, data.size(), per_iteration(encode_time),
+                per_iteration(decode_time));
+}
+
+// Indexes a message of small top level fields with structural_index and
+// with a tag by tag skip through in, reports the bytes indexed per second.
+void index_fields(std::size_t fields, int iterations)
+{
+    std::vector<std::byte> data;
+    zpp::proto::writer writer{data};
+    for (std::size_t i = 0; i < fields; ++i) {
+        auto number = std::uint32_t(i % 40 + 1);
+        if (i % 4) {
+            writer.write_varint(number, std::uint64_t(i) << (i % 30))
+                .or_throw();
+        } else {
+            writer.write_bytes(number, std::string(i % 24, 'x')).or_throw();
+        }
+    }
+    writer.finish().or_throw();
+
+    zpp::proto::structural_index index;
+    auto index_time = std::chrono::steady_clock::duration{};
+    auto skip_time = std::chrono::steady_clock::duration{};
+    std::size_t skipped = 0;
+    for (int i = 0; i < iterations; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        index.build(data).or_throw();
+        auto indexed = std::chrono::steady_clock::now();
+
+        zpp::proto::in input{std::span<const std::byte>{data}};
+        skipped = 0;
+        while (input.position() < data.size()) {
+            std::uint32_t number;
+            zpp::proto::wire_type type;
+            input.read_tag(number, type).or_throw();
+            input.skip_field(type).or_throw();
+            ++skipped;
+        }
+        auto skipped_end = std::chrono::steady_clock::now();
+
+        if (index.size() != fields || skipped != fields) {
+            std::fprintf(stderr, "index: field count mismatch\n");
+            std::exit(1);
+        }
+        index_time += indexed - start;
+        skip_time += skipped_end - indexed;
+    }
+
+    auto throughput = [&](auto duration) {
+        return double(data.size()) * iterations / 1e9 /
+               std::chrono::duration<double>(duration).count();
+    };
+    std::printf("%-14s %8zu fields  %10zu bytes  index %6.2f GB/s  skip "
+                "%6.2f GB/s\n",
+                "index", fields, data.size(), throughput(index_time),
+                throughput(skip_time));
+}
+
+int main()
+{
+    for (std::size_t entries : {1000, 100000}) {
+        int iterations = entries < 10000 ? 200 : 5;
+        round_trip<ordered_phones>("std::map", entries, iterations);
+        round_trip<hashed_phones>("unordered_map", entries, iterations);
+    }
+    index_fields(1000000, 10);
+}
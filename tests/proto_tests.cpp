@@ -1,7 +1,10 @@
 #include <boost/ut.hpp>
 #include <zpp_bits.h>
 #include <zpp_proto.h>
+#include <functional>
 #include <map>
+#include <sstream>
+#include <unordered_map>
 
 namespace ut = boost::ut;
 using namespace zpp::bits::literals;
@@ -532,6 +535,1642 @@ ut::suite test_decode_unknown_field = [] {
     expect(that % p.phones[0].type == person::home);
 };
 
+ut::suite test_trusted_decode = [] {
+    constexpr auto data =
+        "\n-\n\x08John Doe\x10\xd2\t\x1a\x10jdoe@example.com\"\x0c\n\x08"
+        "555-4321\x10\x01\n>\n\nJohn Doe "
+        "2\x10\xd3\t\x1a\x11jdoe2@example.com\"\x0c\n\x08"
+        "555-4322\x10\x01\"\x0c\n\x08"
+        "555-4323\x10\x02"_b;
+
+    using namespace std::literals::string_view_literals;
+    using namespace boost::ut;
+
+    expect(success(zpp::proto::validate<address_book>(data)));
+
+    address_book b;
+    expect(success(zpp::proto::in{data, zpp::proto::trusted{}}(b)));
+    expect((b.people.size() == 2_u) >> fatal);
+    expect(b.people[1].name == "John Doe 2"sv);
+    expect(that % b.people[1].id == 1235);
+    expect((b.people[1].phones.size() == 2_u) >> fatal);
+    expect(b.people[1].phones[1].number == "555-4323"sv);
+    expect(b.people[1].phones[1].type == person::work);
+
+    auto [monster_data, out] = zpp::proto::data_out();
+    monster m = {.pos = {1.0, 2.0, 3.0},
+                 .mana = 200,
+                 .hp = 1000,
+                 .name = "mushroom",
+                 .inventory = {1, 2, 3},
+                 .color = monster::color::blue,
+                 .weapons = {monster::weapon{.name = "sword", .damage = 55}},
+                 .path = {monster::vec3{2.0, 3.0, 4.0}},
+                 .boss = true};
+    out(m).or_throw();
+    expect(success(zpp::proto::validate<monster>(monster_data)));
+
+    monster m2;
+    expect(success(
+        zpp::proto::in{monster_data, zpp::proto::trusted{}}(m2)));
+    expect(m == m2);
+};
+
+struct packed_ids
+{
+    std::vector<zpp::bits::vint32_t> ids;
+};
+
+ut::suite test_validate_rejects_malformed = [] {
+    using namespace boost::ut;
+
+    // truncated nested person
+    constexpr auto truncated = "\n-\n\x08John Doe\x10\xd2\t"_b;
+    expect(failure(zpp::proto::validate<address_book>(truncated)));
+
+    // name (= 1) encoded as a varint
+    constexpr auto wrong_wire_type = "\x08\x01"_b;
+    expect(failure(zpp::proto::validate<person>(wrong_wire_type)));
+
+    // nested length exceeds the enclosing message
+    constexpr auto overflow = "\n\x02\n\x05hello"_b;
+    expect(failure(zpp::proto::validate<address_book>(overflow)));
+
+    // varints longer than their 32-bit member allows
+    constexpr auto long_id = "\x10\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01"_b;
+    expect(failure(zpp::proto::validate<person>(long_id)));
+    person long_person;
+    expect(failure(zpp::proto::in{long_id}(long_person)));
+    constexpr auto long_packed =
+        "\x0a\x0c\x01\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01\x02"_b;
+    expect(failure(zpp::proto::validate<packed_ids>(long_packed)));
+    constexpr auto packed = "\x0a\x07\x01\xff\xff\xff\xff\x0f\x02"_b;
+    expect(success(zpp::proto::validate<packed_ids>(packed)));
+    packed_ids ids;
+    expect(success(zpp::proto::in{packed, zpp::proto::trusted{}}(ids)));
+    expect(ids.ids == std::vector<zpp::bits::vint32_t>{1, -1, 2});
+
+    // unknown fields are skipped, both when validating and decoding
+    constexpr auto unknown = "\x52\x05" "extra\n\x08John Doe"_b;
+    expect(success(zpp::proto::validate<person>(unknown)));
+    person p;
+    expect(success(zpp::proto::in{unknown}(p)));
+    expect(p.name == "John Doe");
+};
+
+ut::suite test_padded_decode = [] {
+    constexpr auto data =
+        "\n\x08John Doe\x10\xd2\t\x1a\x10jdoe@example.com\"\x0c\n\x08"
+        "555-4321\x10\x01"_b;
+
+    using namespace std::literals::string_view_literals;
+    using namespace boost::ut;
+
+    std::vector<std::byte> buffer(data.size() + 16);
+    std::copy(data.begin(), data.end(), buffer.begin());
+    std::span<const std::byte> input{buffer.data(), data.size()};
+
+    person p;
+    expect(success(zpp::proto::in{input, zpp::proto::padded<16>{}}(p)));
+    expect(p.name == "John Doe"sv);
+    expect(that % p.id == 1234);
+    expect(p.email == "jdoe@example.com"sv);
+    expect((p.phones.size() == 1_u) >> fatal);
+    expect(p.phones[0].number == "555-4321"sv);
+    expect(that % p.phones[0].type == person::home);
+
+    // the id varint is cut at the logical end, the padding must not be used
+    std::span<const std::byte> truncated{buffer.data(), 12};
+    expect(failure(zpp::proto::in{truncated, zpp::proto::padded<16>{}}(p)));
+
+    // a tag that starts at the last byte and continues into the padding is
+    // rejected before its value is read from beyond the padding
+    auto tail = "\x90\x80\x80\x80\x00\xff\xff\xff\xff\xff"_b;
+    std::vector<std::byte> exact(tail.begin(), tail.end());
+    expect(zpp::proto::in{std::span<const std::byte>{exact.data(), 1},
+                          zpp::proto::padded<10>{}}(p) ==
+           std::errc::result_out_of_range);
+
+    // an unterminated unknown varint fails the same way with and without
+    // padding
+    auto unterminated =
+        "\x78\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01"_b;
+    std::vector<std::byte> padded_unterminated(unterminated.size() + 16);
+    std::copy(unterminated.begin(), unterminated.end(),
+              padded_unterminated.begin());
+    expect(zpp::proto::in{unterminated}(p) == std::errc::value_too_large);
+    expect(zpp::proto::in{std::span<const std::byte>{
+                              padded_unterminated.data(), unterminated.size()},
+                          zpp::proto::padded<16>{}}(p) ==
+           std::errc::value_too_large);
+};
+
+ut::suite test_field_mask = [] {
+    constexpr auto data =
+        "\n-\n\x08John Doe\x10\xd2\t\x1a\x10jdoe@example.com\"\x0c\n\x08"
+        "555-4321\x10\x01\n>\n\nJohn Doe "
+        "2\x10\xd3\t\x1a\x11jdoe2@example.com\"\x0c\n\x08"
+        "555-4322\x10\x01\"\x0c\n\x08"
+        "555-4323\x10\x02"_b;
+
+    using namespace std::literals::string_view_literals;
+    using namespace boost::ut;
+    using zpp::proto::field;
+    using zpp::proto::fields;
+
+    person p{.email = "untouched"};
+    expect(success(zpp::proto::in{
+        std::span{data}.subspan(2, 45), zpp::proto::fields<1, 2>{}}(p)));
+    expect(p.name == "John Doe"sv);
+    expect(that % p.id == 1234);
+    expect(p.email == "untouched"sv);
+    expect(p.phones.empty());
+
+    address_book b;
+    expect(success(zpp::proto::in{
+        data,
+        zpp::proto::field_mask<field<1, zpp::proto::field_mask<
+                                            field<2>, field<4, fields<1>>>>>{}}(b)));
+    expect((b.people.size() == 2_u) >> fatal);
+    expect(b.people[0].name == ""sv);
+    expect(that % b.people[0].id == 1234);
+    expect(b.people[0].email == ""sv);
+    expect((b.people[1].phones.size() == 2_u) >> fatal);
+    expect(b.people[1].phones[1].number == "555-4323"sv);
+    expect(that % b.people[1].phones[1].type == person::mobile);
+
+    person q{.name = "untouched"};
+    expect(success(
+        zpp::proto::in{std::span{data}.subspan(2, 45), zpp::proto::members<2>{}}(
+            q)));
+    expect(q.name == "untouched"sv);
+    expect(q.email == "jdoe@example.com"sv);
+};
+
+ut::suite test_extract = [] {
+    constexpr auto data =
+        "\n-\n\x08John Doe\x10\xd2\t\x1a\x10jdoe@example.com\"\x0c\n\x08"
+        "555-4321\x10\x01\n>\n\nJohn Doe "
+        "2\x10\xd3\t\x1a\x11jdoe2@example.com\"\x0c\n\x08"
+        "555-4322\x10\x01\"\x0c\n\x08"
+        "555-4323\x10\x02"_b;
+
+    using namespace std::literals::string_view_literals;
+    using namespace boost::ut;
+
+    auto person_data = std::span{data}.subspan(2, 45);
+    auto name = zpp::proto::extract<person, 1>(person_data);
+    expect((success(name)) >> fatal);
+    expect(name.value() == "John Doe"sv);
+
+    auto id = zpp::proto::extract<person, 2>(person_data);
+    expect((success(id)) >> fatal);
+    expect(that % id.value() == 1234);
+
+    auto type = zpp::proto::extract<person, 4, 2>(person_data);
+    expect(std::ranges::distance(type) == 1);
+    expect(*type.begin() == person::home);
+
+    std::vector<std::string_view> numbers;
+    for (auto number : zpp::proto::extract<address_book, 1, 4, 1>(data)) {
+        numbers.push_back(number);
+    }
+    expect(numbers == std::vector{"555-4321"sv, "555-4322"sv, "555-4323"sv});
+
+    std::vector<int> ids;
+    for (auto id : zpp::proto::extract<address_book, 1, 2>(data)) {
+        ids.push_back(id);
+    }
+    expect(ids == std::vector{1234, 1235});
+
+    auto people = zpp::proto::extract<address_book, 1>(data);
+    expect(success(people.error()));
+    auto first = *people.begin();
+    person p;
+    expect(success(zpp::proto::in{first}(p)));
+    expect(p.name == "John Doe"sv);
+
+    auto [packed_data, out] = zpp::proto::data_out();
+    out(repeated_integers{.integers = {1, -2, 300}}).or_throw();
+    std::vector<int> integers;
+    for (auto i : zpp::proto::extract<repeated_integers, 1>(packed_data)) {
+        integers.push_back(i);
+    }
+    expect(integers == std::vector{1, -2, 300});
+
+    auto missing = zpp::proto::extract<person, 3>(""_b);
+    expect(success(missing) && missing.value().empty());
+
+    constexpr auto truncated = "\n-\n\x08John Doe\x10\xd2\t"_b;
+    expect(failure(zpp::proto::extract<address_book, 1, 4, 1>(truncated).error()));
+};
+
+ut::suite test_structural_index = [] {
+    constexpr auto data =
+        "\n-\n\x08John Doe\x10\xd2\t\x1a\x10jdoe@example.com\"\x0c\n\x08"
+        "555-4321\x10\x01\n>\n\nJohn Doe "
+        "2\x10\xd3\t\x1a\x11jdoe2@example.com\"\x0c\n\x08"
+        "555-4322\x10\x01\"\x0c\n\x08"
+        "555-4323\x10\x02"_b;
+
+    using namespace std::literals::string_view_literals;
+    using namespace boost::ut;
+
+    zpp::proto::structural_index book_index;
+    expect(success(book_index.build(data)));
+    expect((book_index.size() == 2_u) >> fatal);
+    expect(book_index.fields()[0].offset == 0_u);
+    expect(book_index.fields()[0].value_offset == 2_u);
+    expect(book_index.fields()[0].value_size == 45_u);
+    expect(book_index.fields()[1].value_offset == 49_u);
+    expect(book_index.fields()[1].value_size == 62_u);
+    expect(std::ranges::distance(book_index.find_all(1)) == 2);
+
+    auto second = book_index.find(1);
+    expect((second != nullptr) >> fatal);
+    person p;
+    expect(success(zpp::proto::in{std::span{data}.subspan(
+        second->value_offset, second->value_size)}(p)));
+    expect(p.name == "John Doe 2"sv);
+
+    zpp::proto::structural_index person_index{
+        std::span{data}.subspan(second->value_offset, second->value_size)};
+    expect((person_index.size() == 5_u) >> fatal);
+    auto id = person_index.find(2);
+    expect((id != nullptr) >> fatal);
+    expect(id->type == zpp::proto::wire_type::varint);
+    expect(id->value_size == 2_u);
+    expect(std::ranges::distance(person_index.find_all(4)) == 2);
+    expect(person_index.find(3)->value_size == 17_u);
+    expect(person_index.find(5) == nullptr);
+
+    std::vector<std::byte> large;
+    for (int i = 0; i < 100; ++i) {
+        large.insert(large.end(), data.begin(), data.end());
+    }
+    zpp::proto::structural_index large_index;
+    expect(success(large_index.build(large)));
+    expect(large_index.size() == 200_u);
+    expect(large_index.fields().back().value_offset ==
+           large.size() - 62);
+
+    large.pop_back();
+    expect(failure(large_index.build(large)));
+
+    // Tags, varints and lengths of every size, many of them per window.
+    std::vector<std::byte> mixed;
+    zpp::proto::writer writer{mixed};
+    std::vector<std::tuple<std::uint32_t, zpp::proto::wire_type, std::size_t>>
+        expected;
+    for (std::uint32_t i = 0; i < 300; ++i) {
+        auto number = std::uint32_t(1) << (i % 29);
+        if (i % 3) {
+            auto value = i % 64 == 63 ? ~std::uint64_t{}
+                                      : std::uint64_t(1) << (i % 64);
+            writer.write_varint(number, value).or_throw();
+            expected.emplace_back(number, zpp::proto::wire_type::varint,
+                                  zpp::bits::varint_size(value));
+        } else {
+            std::string bytes(i * i % 20000, 'x');
+            writer.write_bytes(number, bytes).or_throw();
+            expected.emplace_back(number,
+                                  zpp::proto::wire_type::length_delimited,
+                                  bytes.size());
+        }
+    }
+    writer.finish().or_throw();
+    zpp::proto::structural_index mixed_index;
+    expect(success(mixed_index.build(mixed)));
+    expect((mixed_index.size() == expected.size()) >> fatal);
+    for (std::size_t i = 0; i < expected.size(); ++i) {
+        auto &field = mixed_index.fields()[i];
+        expect(field.number == std::get<0>(expected[i]));
+        expect(field.type == std::get<1>(expected[i]));
+        expect(field.value_size == std::get<2>(expected[i]));
+    }
+};
+
+ut::suite test_view = [] {
+    constexpr auto data =
+        "\n-\n\x08John Doe\x10\xd2\t\x1a\x10jdoe@example.com\"\x0c\n\x08"
+        "555-4321\x10\x01\n>\n\nJohn Doe "
+        "2\x10\xd3\t\x1a\x11jdoe2@example.com\"\x0c\n\x08"
+        "555-4322\x10\x01\"\x0c\n\x08"
+        "555-4323\x10\x02"_b;
+
+    using namespace std::literals::string_view_literals;
+    using namespace boost::ut;
+
+    zpp::proto::view<address_book> book{data};
+    expect(success(book.error()));
+
+    auto people = book.get<0>();
+    static_assert(std::ranges::forward_range<decltype(people)>);
+    expect(std::ranges::distance(people) == 2);
+
+    auto second = *std::next(people.begin());
+    expect(success(second.error()));
+    expect(second.get<0>() == "John Doe 2"sv);
+    expect(that % second.field<2>() == 1235);
+    expect(second.get<2>() == "jdoe2@example.com"sv);
+
+    std::vector<std::string_view> numbers;
+    std::vector<person::phone_type> types;
+    for (auto phone : second.get<3>()) {
+        numbers.push_back(phone.get<0>());
+        types.push_back(phone.get<1>());
+    }
+    expect(numbers == std::vector{"555-4322"sv, "555-4323"sv});
+    expect(types == std::vector{person::home, person::work});
+
+    zpp::proto::view<person> empty{""_b};
+    expect(empty.get<0>() == ""sv);
+    expect(that % empty.get<1>() == 0);
+    expect(!empty.has<3>());
+    expect(empty.get<3>().begin() == empty.get<3>().end());
+
+    auto nested_data = "0a03089601"_decode_hex;
+    zpp::proto::view<nested_example> nested{nested_data};
+    expect(that % nested.get<0>().get<0>() == 150);
+
+    auto [monster_data, out] = zpp::proto::data_out();
+    out(monster{.pos = {1.0, 2.0, 3.0},
+                .hp = 1000,
+                .inventory = {1, 2, 3},
+                .path = {monster::vec3{2.0, 3.0, 4.0}}})
+        .or_throw();
+    zpp::proto::view<monster> m{monster_data};
+    expect(m.get<0>().get<2>() == 3.0f);
+    expect(that % m.get<2>() == 1000);
+    auto inventory = m.get<4>();
+    expect(std::vector<std::byte>(inventory.begin(), inventory.end()) ==
+           std::vector{std::byte{1}, std::byte{2}, std::byte{3}});
+    expect((*m.get<8>().begin()).get<1>() == 3.0f);
+};
+
+struct directory
+{
+    std::string title;          // = 1
+    std::vector<person> people; // = 2
+    zpp::bits::vint32_t count;  // = 3
+};
+
+ut::suite test_parallel_decode = [] {
+    using namespace boost::ut;
+
+    directory original{.title = "staff", .count = 5000};
+    for (int i = 0; i < 5000; ++i) {
+        original.people.push_back(
+            person{.name = "person " + std::to_string(i),
+                   .id = i,
+                   .email = std::to_string(i) + "@example.com",
+                   .phones = {{std::to_string(i * 7), person::work}}});
+    }
+    auto [data, out] = zpp::proto::data_out();
+    out(original).or_throw();
+
+    auto encode = [](const directory &value) {
+        auto [bytes, out] = zpp::proto::data_out();
+        out(value).or_throw();
+        return bytes;
+    };
+
+    directory parallel{.people = {person{.name = "stale"}}};
+    expect(success(zpp::proto::deserialize_parallel<2>(
+        data, parallel, zpp::proto::parallel<0, 4>{})));
+    expect(parallel.title == "staff");
+    expect(that % parallel.count == 5000);
+    expect((parallel.people.size() == 5000_u) >> fatal);
+    expect(parallel.people[4321].name == "person 4321");
+    expect(encode(parallel) == data);
+
+    directory serial;
+    expect(success(zpp::proto::deserialize_parallel<2>(data, serial)));
+    expect(encode(serial) == data);
+
+    // A field mask applies to the directory and its sub-mask to the people.
+    using mask = zpp::proto::field_mask<
+        zpp::proto::field<1>,
+        zpp::proto::field<2, zpp::proto::fields<2>>>;
+    directory masked{.count = 7};
+    expect(success(zpp::proto::deserialize_parallel<2>(
+        data, masked, zpp::proto::parallel<0, 4>{}, mask{})));
+    expect(masked.title == "staff");
+    expect(that % masked.count == 7);
+    expect((masked.people.size() == 5000_u) >> fatal);
+    expect(masked.people[4321].name.empty());
+    expect(that % masked.people[4321].id == 4321);
+
+    directory unselected;
+    expect(success(zpp::proto::deserialize_parallel<2>(
+        data, unselected, zpp::proto::parallel<0, 4>{},
+        zpp::proto::fields<3>{})));
+    expect(unselected.people.empty());
+    expect(that % unselected.count == 5000);
+
+    auto truncated = std::span{data}.first(data.size() - 5);
+    directory broken;
+    expect(failure(zpp::proto::deserialize_parallel<2>(
+        truncated, broken, zpp::proto::parallel<0, 4>{})));
+};
+
+struct rejected_value
+{
+    constexpr static zpp::bits::errc serialize(auto &, auto &)
+    {
+        return std::errc::invalid_argument;
+    }
+
+    std::uint32_t value;
+};
+
+struct rejected_entry
+{
+    rejected_value value; // = 1
+};
+
+struct rejected_list
+{
+    std::vector<rejected_entry> entries; // = 1
+};
+
+ut::suite test_parallel_encode = [] {
+    using namespace boost::ut;
+
+    directory original{.title = "staff", .count = 3000};
+    for (int i = 0; i < 3000; ++i) {
+        original.people.push_back(person{
+            .name = std::string(i % 200, 'x'),
+            .id = i - 1000,
+            .email = std::to_string(i) + "@example.com",
+            .phones = {{std::to_string(i * 7), person::phone_type(i % 3)}}});
+    }
+
+    auto [serial, serial_out] = zpp::proto::data_out();
+    serial_out(original).or_throw();
+    expect(zpp::proto::message_size(original) == serial.size());
+
+    std::vector<std::byte> parallel;
+    zpp::proto::out parallel_out{parallel, zpp::proto::parallel<0, 4>{}};
+    parallel_out(original).or_throw();
+    expect(parallel == serial);
+
+    std::vector<std::byte> below_threshold;
+    zpp::proto::out below_threshold_out{below_threshold,
+                                        zpp::proto::parallel<>{}};
+    below_threshold_out(original).or_throw();
+    expect(below_threshold == serial);
+
+    std::vector<std::byte> crossing;
+    zpp::proto::out crossing_out{crossing,
+                                 zpp::proto::parallel<(1 << 16), 4>{}};
+    crossing_out(original).or_throw();
+    expect(crossing == serial);
+
+    std::array<std::byte, 64> small;
+    zpp::proto::out small_out{small, zpp::proto::parallel<0, 4>{}};
+    expect(failure(small_out(original)));
+
+    rejected_list rejected{.entries = {{}, {}}};
+    zpp::bits::errc error;
+    zpp::proto::message_size(rejected, error);
+    expect(error == std::errc::invalid_argument);
+    std::vector<std::byte> rejected_data;
+    zpp::proto::out rejected_out{rejected_data, zpp::proto::parallel<0, 4>{}};
+    expect(rejected_out(rejected) == std::errc::invalid_argument);
+};
+
+ut::suite test_batch = [] {
+    using namespace boost::ut;
+
+    std::vector<person> people;
+    for (int i = 0; i < 300; ++i) {
+        people.push_back(person{.name = "person " + std::to_string(i),
+                                .id = i,
+                                .phones = {{"555", person::home}}});
+    }
+
+    std::vector<std::byte> data;
+    expect(success(zpp::proto::serialize_batch(data, std::span{people})));
+
+    auto count = zpp::proto::batch_size(data);
+    expect((success(count) && count.value() == 300_u) >> fatal);
+
+    std::vector<person> decoded(count.value());
+    expect(success(zpp::proto::deserialize_batch(data, std::span{decoded})));
+    expect(decoded[0].name == "person 0");
+    expect(decoded[299].name == "person 299");
+    expect(that % decoded[42].id == 42);
+    expect(decoded[299].phones[0].type == person::home);
+
+    std::vector<std::byte> reencoded;
+    expect(success(
+        zpp::proto::serialize_batch(reencoded, std::span{decoded})));
+    expect(reencoded == data);
+
+    std::vector<person> too_few(10);
+    expect(failure(zpp::proto::deserialize_batch(data, std::span{too_few})));
+
+    auto truncated = std::span{data}.first(data.size() - 1);
+    expect(failure(
+        zpp::proto::deserialize_batch(truncated, std::span{decoded})));
+
+    std::vector<std::byte> empty;
+    expect(success(
+        zpp::proto::serialize_batch(empty, std::span<const person>{})));
+    expect(empty == std::vector{std::byte{0}});
+};
+
+struct replicated
+{
+    std::uint64_t sequence;    // = 1
+    std::uint32_t timestamp;   // = 2
+    zpp::bits::vuint32_t epoch; // = 3
+    std::string payload;       // = 4
+};
+
+ut::suite test_patch = [] {
+    using namespace boost::ut;
+
+    auto encode = [](const replicated &value) {
+        auto [data, out] = zpp::proto::data_out();
+        out(value).or_throw();
+        return data;
+    };
+    auto decode = [](auto &&data) {
+        replicated value;
+        zpp::proto::in{data}(value).or_throw();
+        return value;
+    };
+
+    auto data = encode({.sequence = 7, .timestamp = 100, .epoch = 3,
+                        .payload = "opaque"});
+
+    expect(success(zpp::proto::patch<replicated, 1>(data, 8)));
+    expect(success(zpp::proto::patch<replicated, 2>(data, 200)));
+    expect(success(zpp::proto::patch<replicated, 3>(data, 127)));
+    expect(failure(zpp::proto::patch<replicated, 3>(data, 128)));
+
+    auto value = decode(data);
+    expect(that % value.sequence == 8u);
+    expect(that % value.timestamp == 200u);
+    expect(that % value.epoch == 127u);
+    expect(value.payload == "opaque");
+
+    zpp::proto::structural_index index{data};
+    auto location = index.find(1);
+    expect((location != nullptr) >> fatal);
+    expect(success(zpp::proto::patch_at<replicated, 1>(
+        data, location->value_offset, 9)));
+    expect(that % decode(data).sequence == 9u);
+
+    auto absent = encode({.sequence = 1});
+    expect(failure(zpp::proto::patch<replicated, 2>(absent, 5)));
+
+    std::vector<std::vector<std::byte>> buffers{
+        encode({.sequence = 1, .timestamp = 1}),
+        encode({.sequence = 2, .timestamp = 1, .payload = "x"}),
+        encode({.sequence = 3, .timestamp = 1, .epoch = 1})};
+    expect(success(zpp::proto::patch_batch<replicated, 2>(buffers, 42)));
+    expect(success(zpp::proto::patch_batch<replicated, 1>(
+        buffers, std::vector<std::uint64_t>{10, 20, 30})));
+    for (std::size_t i = 0; i < buffers.size(); ++i) {
+        expect(that % decode(buffers[i]).timestamp == 42u);
+        expect(that % decode(buffers[i]).sequence == (i + 1) * 10);
+    }
+
+    auto unchanged = buffers;
+    expect(zpp::proto::patch_batch<replicated, 1>(
+               buffers, std::vector<std::uint64_t>{7, 7}) ==
+           std::errc::invalid_argument);
+    expect(buffers == unchanged);
+};
+
+struct routing_header
+{
+    std::string route;       // = 1
+    zpp::bits::vuint64_t id; // = 2
+};
+
+struct envelope
+{
+    routing_header header; // = 1
+    std::string body;      // = 2
+};
+
+struct frame
+{
+    envelope message;    // = 1
+    std::uint32_t check; // = 2
+};
+
+ut::suite test_splice = [] {
+    using namespace boost::ut;
+
+    auto decode = [](auto &&data) {
+        frame value;
+        zpp::proto::in{data}(value).or_throw();
+        return value;
+    };
+
+    auto [data, out] = zpp::proto::data_out();
+    out(frame{.message = {.header = {.route = "a.b", .id = 5},
+                          .body = std::string(100, 'b')},
+              .check = 77})
+        .or_throw();
+
+    expect(success(
+        zpp::proto::splice<frame, 1, 1, 1>(data, std::string(300, 'r'))));
+    auto value = decode(data);
+    expect(value.message.header.route == std::string(300, 'r'));
+    expect(that % value.message.header.id == 5u);
+    expect(value.message.body == std::string(100, 'b'));
+    expect(that % value.check == 77u);
+
+    expect(success(zpp::proto::splice<frame, 1, 1, 1>(data, "c.d")));
+    value = decode(data);
+    expect(value.message.header.route == "c.d");
+    expect(value.message.body == std::string(100, 'b'));
+
+    expect(success(zpp::proto::splice<frame, 1, 1>(
+        data, routing_header{.route = "e", .id = 9})));
+    value = decode(data);
+    expect(value.message.header.route == "e");
+    expect(that % value.message.header.id == 9u);
+
+    expect(success(zpp::proto::splice<frame, 1, 2>(data, "")));
+    value = decode(data);
+    expect(value.message.body.empty());
+    expect(that % value.check == 77u);
+
+    auto check_only = "1501000000"_decode_hex;
+    std::vector<std::byte> bare(check_only.begin(), check_only.end());
+    expect(failure(zpp::proto::splice<frame, 1, 1, 1>(bare, "x")));
+    expect(success(zpp::proto::splice<frame, 1>(
+        bare, envelope{.header = {.route = "x"}})));
+    expect(decode(bare).message.header.route == "x");
+    expect(that % decode(bare).check == 1u);
+
+    auto encode = [](const auto &value) {
+        auto [data, out] = zpp::proto::data_out();
+        out(value).or_throw();
+        return data;
+    };
+
+    auto scalars = encode(frame{.message = {.header = {.id = 5}}, .check = 7});
+    expect(success(zpp::proto::splice<frame, 1, 1, 2>(scalars, 300u)));
+    expect(success(zpp::proto::splice<frame, 2>(scalars, 9u)));
+    expect(scalars ==
+           encode(frame{.message = {.header = {.id = 300}}, .check = 9}));
+};
+
+struct snapshot
+{
+    zpp::proto::cached<person> owner;     // = 1
+    zpp::proto::cached<address_book> book; // = 2
+    zpp::bits::vuint32_t tick;             // = 3
+};
+
+ut::suite test_cached = [] {
+    using namespace boost::ut;
+
+    auto encode = [](const auto &value) {
+        auto [data, out] = zpp::proto::data_out();
+        out(value).or_throw();
+        return data;
+    };
+
+    snapshot state{.owner = person{.name = "owner", .id = 1},
+                   .book = address_book{{person{.name = "a"},
+                                         person{.name = "b"}}},
+                   .tick = 1};
+    expect(state.owner.dirty() && state.book.dirty());
+
+    auto first = encode(state);
+    expect(!state.owner.dirty() && !state.book.dirty());
+    expect(state.owner.bytes().size() == zpp::proto::message_size(
+                                             state.owner.get()));
+    expect(zpp::proto::message_size(state) == first.size());
+
+    state.tick = 2;
+    state.book.modify([](auto &book) { book.people[1].name = "c"; });
+    expect(!state.owner.dirty() && state.book.dirty());
+
+    auto second = encode(state);
+    snapshot plain_copy{.owner = state.owner.get(),
+                        .book = state.book.get(),
+                        .tick = 2};
+    expect(second == encode(plain_copy));
+
+    snapshot decoded;
+    zpp::proto::in{second}(decoded).or_throw();
+    expect(!decoded.owner.dirty() && !decoded.book.dirty());
+    expect(decoded.owner.get().name == "owner");
+    expect(decoded.book.get().people[1].name == "c");
+    expect(that % decoded.tick == 2u);
+    expect(encode(decoded) == second);
+    expect(success(zpp::proto::validate<snapshot>(second)));
+
+    snapshot partial;
+    zpp::proto::in{second,
+                   zpp::proto::field_mask<zpp::proto::field<
+                       1, zpp::proto::fields<1>>>{}}(partial)
+        .or_throw();
+    expect(partial.owner.dirty());
+    expect(partial.owner.get().name == "owner");
+    expect(that % partial.owner.get().id == 0);
+};
+
+struct reply
+{
+    zpp::proto::pre_encoded<person> server; // = 1
+    zpp::bits::vuint32_t sequence;          // = 2
+};
+
+struct plain_reply
+{
+    person server;                 // = 1
+    zpp::bits::vuint32_t sequence; // = 2
+};
+
+ut::suite test_pre_encoded = [] {
+    using namespace boost::ut;
+
+    auto encode = [](const auto &value) {
+        auto [data, out] = zpp::proto::data_out();
+        out(value).or_throw();
+        return data;
+    };
+
+    person identity{.name = "server-1",
+                    .id = 7,
+                    .phones = {{"555", person::work}}};
+    zpp::proto::pre_encoded<person> server{identity};
+    expect(server.encoded().size() ==
+           zpp::proto::length_delimited_size(
+               zpp::proto::message_size(identity)));
+
+    for (unsigned sequence = 0; sequence < 3; ++sequence) {
+        auto data = encode(reply{.server = server, .sequence = sequence});
+        expect(data == encode(plain_reply{.server = identity,
+                                          .sequence = sequence}));
+        expect(zpp::proto::message_size(
+                   reply{.server = server, .sequence = sequence}) ==
+               data.size());
+    }
+
+    auto data = encode(reply{.server = server, .sequence = 9});
+    reply decoded;
+    zpp::proto::in{data}(decoded).or_throw();
+    expect(decoded.server.get().name == "server-1");
+    expect(that % decoded.server.get().id == 7);
+    expect(decoded.server.get().phones[0].type == person::work);
+    expect(that % decoded.sequence == 9u);
+    expect(encode(decoded) == data);
+    expect(decoded.server.encoded().size() == server.encoded().size());
+};
+
+struct heartbeat
+{
+    std::uint64_t id;           // = 1
+    zpp::bits::vuint32_t node;  // = 2
+    std::uint32_t timestamp;    // = 3
+    example status;             // = 4
+};
+
+ut::suite test_message_template = [] {
+    using namespace boost::ut;
+
+    using heartbeat_template =
+        zpp::proto::message_template<heartbeat{.node = 12,
+                                               .status = example{3}},
+                                     1, 3>;
+    static_assert(heartbeat_template::offsets.size() == 2);
+    static_assert(heartbeat_template::make(5, 6) ==
+                  zpp::proto::to_bytes<heartbeat{.id = 5,
+                                                 .node = 12,
+                                                 .timestamp = 6,
+                                                 .status = example{3}}>());
+
+    std::vector<std::byte> data(heartbeat_template::size);
+    heartbeat_template::write(data.data(), 0x1122334455667788, 0);
+
+    heartbeat value;
+    zpp::proto::in{data}(value).or_throw();
+    expect(that % value.id == 0x1122334455667788u);
+    expect(that % value.node == 12u);
+    expect(that % value.timestamp == 0u);
+    expect(that % value.status.i == 3);
+};
+
+ut::suite test_parse_events = [] {
+    constexpr auto data =
+        "\n\x08John Doe\x10\xd2\t\x1a\x10jdoe@example.com\"\x0c\n\x08"
+        "555-4321\x10\x01"_b;
+
+    using namespace std::literals::string_view_literals;
+    using namespace boost::ut;
+    using event = zpp::proto::field_event<std::byte>;
+
+    struct recorder
+    {
+        zpp::proto::event_action operator()(const event &e)
+        {
+            fields.push_back({e.depth, e.number});
+            if (e.number == 2 && e.depth == 0) {
+                id = e.as<int>();
+            }
+            if (e.number == 1 && e.depth == 1) {
+                number = std::string_view(
+                    reinterpret_cast<const char *>(e.bytes.data()),
+                    e.bytes.size());
+            }
+            return e.number == 4 ? zpp::proto::event_action::enter
+                                 : zpp::proto::event_action::next;
+        }
+
+        void end_message(const event &e)
+        {
+            ended.push_back(e.number);
+        }
+
+        std::vector<std::pair<std::size_t, std::uint32_t>> fields;
+        std::vector<std::uint32_t> ended;
+        int id = 0;
+        std::string_view number;
+    };
+
+    recorder handler;
+    expect(success(zpp::proto::parse_events(data, handler)));
+    expect(handler.fields ==
+           std::vector<std::pair<std::size_t, std::uint32_t>>{
+               {0, 1}, {0, 2}, {0, 3}, {0, 4}, {1, 1}, {1, 2}});
+    expect(handler.ended == std::vector<std::uint32_t>{4});
+    expect(that % handler.id == 1234);
+    expect(handler.number == "555-4321"sv);
+
+    std::size_t count = 0;
+    expect(success(zpp::proto::parse_events(data, [&](const event &) {
+        ++count;
+        return zpp::proto::event_action::stop;
+    })));
+    expect(count == 1_u);
+
+    count = 0;
+    expect(success(zpp::proto::parse_events(
+        data, [&](const event &) { ++count; })));
+    expect(count == 4_u);
+
+    expect(event{.value = 3}.as<zpp::bits::vsint32_t>() == -2);
+    expect(event{.value = 0x3f800000}.as<float>() == 1.0f);
+
+    expect(failure(zpp::proto::parse_events(
+        "\n\x08John"_b, [](const event &) {})));
+    expect(failure(zpp::proto::parse_events(
+        "\"\x02\n\x08"_b,
+        [](const event &) { return zpp::proto::event_action::enter; })));
+};
+
+ut::suite test_writer = [] {
+    using namespace boost::ut;
+
+    person expected{.name = "John Doe",
+                    .id = -1234,
+                    .email = std::string(200, 'e'),
+                    .phones = {{"555-4321", person::home},
+                               {std::string(150, '5'), person::work}}};
+    auto [data, out] = zpp::proto::data_out();
+    out(expected).or_throw();
+
+    std::vector<std::byte> built;
+    zpp::proto::writer writer{built};
+    expect(success(writer.write_bytes(1, std::string_view{"John Doe"})));
+    expect(success(writer.write_varint(2, -1234)));
+    expect(success(writer.write_bytes(3, expected.email)));
+    for (auto &phone : expected.phones) {
+        expect(success(writer.begin_message(4)));
+        expect(success(writer.write_bytes(1, phone.number)));
+        expect(success(writer.write_varint(2, phone.type)));
+        expect(success(writer.end_message()));
+    }
+    expect(success(writer.finish()));
+    expect(built == data);
+
+    std::vector<std::byte> nested;
+    zpp::proto::writer nested_writer{nested};
+    expect(success(nested_writer.begin_message(1)));
+    expect(success(nested_writer.begin_message(1)));
+    expect(success(nested_writer.write_varint(1, 150)));
+    expect(success(nested_writer.end_message()));
+    expect(failure(nested_writer.finish()));
+    expect(success(nested_writer.end_message()));
+    expect(failure(nested_writer.end_message()));
+    expect(success(nested_writer.finish()));
+    expect(nested == std::vector<std::byte>{std::byte{0x0a}, std::byte{0x05},
+                                            std::byte{0x0a}, std::byte{0x03},
+                                            std::byte{0x08}, std::byte{0x96},
+                                            std::byte{0x01}});
+
+    std::vector<std::byte> fixed;
+    zpp::proto::writer fixed_writer{fixed};
+    expect(success(fixed_writer.write_fixed32(1, 1.0f)));
+    expect(success(fixed_writer.write_fixed64(2, std::uint64_t{7})));
+    expect(success(fixed_writer.finish()));
+    expect(fixed.size() == 14_u);
+};
+
+template <typename People, typename Ids>
+struct generated_book
+{
+    People people; // = 1
+    Ids ids;       // = 2
+};
+
+struct materialized_book
+{
+    std::vector<person> people;            // = 1
+    std::vector<zpp::bits::vint32_t> ids; // = 2
+};
+
+ut::suite test_encode_ranges = [] {
+    using namespace boost::ut;
+
+    std::map<int, std::string> names{{1, "a"}, {2, "b"}, {3, "c"}};
+    auto to_person = [](const auto &entry) {
+        return person{.name = entry.second, .id = entry.first};
+    };
+    auto to_id = [](int id) { return zpp::bits::vint32_t{id * 100}; };
+
+    materialized_book expected;
+    for (auto &entry : names) {
+        expected.people.push_back(to_person(entry));
+        expected.ids.push_back(to_id(entry.first));
+    }
+    auto [data, out] = zpp::proto::data_out();
+    out(expected).or_throw();
+
+    generated_book generated{
+        names | std::views::transform(to_person),
+        std::views::iota(1, 4) | std::views::transform(to_id)};
+    std::vector<std::byte> encoded;
+    zpp::proto::out{encoded}(generated).or_throw();
+    expect(encoded == data);
+    expect(zpp::proto::message_size(generated) == encoded.size());
+
+    std::vector<int> values{1, -2, 3, 400, 5};
+    auto odd = values | std::views::filter([](int v) { return v % 2; });
+    generated_book filtered{std::vector<person>{}, odd};
+    std::vector<std::byte> filtered_data;
+    zpp::proto::out{filtered_data}(filtered).or_throw();
+
+    struct packed_ints
+    {
+        std::vector<person> people; // = 1
+        std::vector<int> values;    // = 2
+    };
+    packed_ints decoded;
+    zpp::proto::in{filtered_data}(decoded).or_throw();
+    expect(decoded.values == std::vector{1, 3, 5});
+
+    std::istringstream stream{"1 2 3 4"};
+    generated_book single_pass{std::vector<person>{},
+                               std::views::istream<int>(stream)};
+    std::vector<std::byte> single_pass_data;
+    zpp::proto::out{single_pass_data}(single_pass).or_throw();
+    zpp::proto::in{single_pass_data}(decoded).or_throw();
+    expect(decoded.values == std::vector{1, 2, 3, 4});
+};
+
+struct streamed_directory
+{
+    std::string title;                                            // = 1
+    zpp::proto::sink<person, std::function<void(person &)>> people; // = 2
+    zpp::bits::vint32_t count;                                    // = 3
+};
+
+ut::suite test_sink = [] {
+    using namespace boost::ut;
+
+    directory original{.title = "staff", .count = 3};
+    for (int i = 0; i < 3; ++i) {
+        original.people.push_back(person{.name = "person " + std::to_string(i),
+                                         .id = i,
+                                         .phones = {{"555", person::home}}});
+    }
+    auto [data, out] = zpp::proto::data_out();
+    out(original).or_throw();
+
+    std::vector<std::string> names;
+    int phones = 0;
+    streamed_directory streamed{
+        .people = std::function<void(person &)>{[&](person &p) {
+            names.push_back(std::move(p.name));
+            phones += int(p.phones.size());
+        }}};
+    zpp::proto::in{data}(streamed).or_throw();
+
+    expect(streamed.title == "staff");
+    expect(that % streamed.count == 3);
+    expect(streamed.people.count() == 3_u);
+    expect(names ==
+           std::vector<std::string>{"person 0", "person 1", "person 2"});
+    expect(that % phones == 3);
+    expect(success(zpp::proto::validate<streamed_directory>(data)));
+
+    struct stopping_directory
+    {
+        std::string title;
+        zpp::proto::sink<person, std::function<zpp::bits::errc(person &)>>
+            people;
+    };
+    stopping_directory stopping{
+        .people = std::function<zpp::bits::errc(person &)>{[](person &p) {
+            return p.id == 1 ? zpp::bits::errc{std::errc::operation_canceled}
+                             : zpp::bits::errc{};
+        }}};
+    expect(failure(zpp::proto::in{data}(stopping)));
+    expect(stopping.people.count() == 2_u);
+};
+
+// A minimal sorted flat map exposing the extract()/replace() interface.
+template <typename Key, typename Value>
+struct sorted_vector_map
+{
+    using key_type = Key;
+    using mapped_type = Value;
+    using value_type = std::pair<Key, Value>;
+    using key_compare = std::less<Key>;
+
+    struct containers
+    {
+        std::vector<Key> keys;
+        std::vector<Value> values;
+    };
+
+    containers extract() &&
+    {
+        containers result;
+        for (auto &[key, value] : entries) {
+            result.keys.push_back(std::move(key));
+            result.values.push_back(std::move(value));
+        }
+        entries.clear();
+        return result;
+    }
+
+    void replace(std::vector<Key> &&keys, std::vector<Value> &&values)
+    {
+        entries.clear();
+        for (std::size_t i = 0; i < keys.size(); ++i) {
+            entries.emplace_back(std::move(keys[i]), std::move(values[i]));
+        }
+    }
+
+    void insert(value_type entry)
+    {
+        entries.push_back(std::move(entry));
+    }
+
+    auto begin() const
+    {
+        return entries.begin();
+    }
+
+    auto end() const
+    {
+        return entries.end();
+    }
+
+    std::size_t size() const
+    {
+        return entries.size();
+    }
+
+    void clear()
+    {
+        entries.clear();
+    }
+
+    std::vector<value_type> entries;
+};
+
+struct map_holder
+{
+    std::unordered_map<std::string, int> hashed;  // = 1
+    std::map<std::string, int> ordered;           // = 2
+    sorted_vector_map<std::string, int> flat;     // = 3
+    int tail;                                     // = 4
+};
+
+struct map_holder_parent
+{
+    map_holder child;                         // = 1
+    std::map<std::string, int> ordered;       // = 2
+};
+
+struct map_tree
+{
+    sorted_vector_map<std::string, int> flat; // = 1
+    std::map<std::string, int> ordered;       // = 2
+    std::vector<map_tree> children;           // = 3
+};
+
+ut::suite test_bulk_map_decode = [] {
+    using namespace boost::ut;
+
+    auto key = [](int i) {
+        auto digits = std::to_string(i);
+        return "key" + std::string(5 - digits.size(), '0') + digits;
+    };
+    auto write_entry = [](auto &writer, std::uint32_t field,
+                          const std::string &key, int value) {
+        writer.begin_message(field).or_throw();
+        writer.write_bytes(1, key).or_throw();
+        writer.write_fixed32(2, value).or_throw();
+        writer.end_message().or_throw();
+    };
+
+    std::vector<std::byte> data;
+    zpp::proto::writer writer{data};
+    for (int i = 0; i < 1000; ++i) {
+        write_entry(writer, 1, key((i * 7919) % 1000), i);
+    }
+    for (int i = 0; i < 1000; ++i) {
+        write_entry(writer, 2, key(i), i);
+    }
+    for (int i = 999; i >= 0; --i) {
+        write_entry(writer, 3, key(i), i);
+    }
+    write_entry(writer, 3, key(5), -5);
+    write_entry(writer, 2, key(5), -5);
+    writer.write_fixed32(4, 42).or_throw();
+    writer.finish().or_throw();
+
+    map_holder holder;
+    zpp::proto::in{data}(holder).or_throw();
+    expect(holder.hashed.size() == 1000_u);
+    expect(that % holder.hashed.at(key(7919 % 1000)) == 1);
+    expect(holder.ordered.size() == 1000_u);
+    expect(that % holder.ordered.at(key(5)) == -5);
+    expect(that % holder.ordered.at(key(6)) == 6);
+    expect((holder.flat.size() == 1000_u) >> fatal);
+    expect(std::ranges::is_sorted(holder.flat.entries));
+    expect(that % holder.flat.entries[5].second == -5);
+    expect(that % holder.flat.entries[999].second == 999);
+    expect(that % holder.tail == 42);
+
+    std::vector<std::byte> nested;
+    zpp::proto::writer nested_writer{nested};
+    nested_writer.begin_message(1).or_throw();
+    write_entry(nested_writer, 2, key(1), 1);
+    nested_writer.end_message().or_throw();
+    write_entry(nested_writer, 2, key(2), 2);
+    nested_writer.finish().or_throw();
+
+    map_holder_parent parent;
+    zpp::proto::in{nested}(parent).or_throw();
+    expect(parent.child.ordered.size() == 1_u);
+    expect(parent.ordered.size() == 1_u);
+    expect(parent.ordered.contains(key(2)));
+
+    static_assert(zpp::bits::concepts::self_referencing<map_tree>);
+    std::vector<std::byte> tree_data;
+    zpp::proto::writer tree_writer{tree_data};
+    for (int i = 9; i >= 0; --i) {
+        write_entry(tree_writer, 1, key(i), i);
+    }
+    write_entry(tree_writer, 1, key(3), -3);
+    tree_writer.begin_message(3).or_throw();
+    write_entry(tree_writer, 2, key(1), 1);
+    write_entry(tree_writer, 2, key(1), -1);
+    tree_writer.end_message().or_throw();
+    tree_writer.finish().or_throw();
+
+    map_tree tree;
+    zpp::proto::in{tree_data}(tree).or_throw();
+    expect((tree.flat.size() == 10_u) >> fatal);
+    expect(std::ranges::is_sorted(tree.flat.entries));
+    expect(that % tree.flat.entries[3].second == -3);
+    expect((tree.children.size() == 1_u) >> fatal);
+    expect(that % tree.children[0].ordered.at(key(1)) == -1);
+};
+
+struct large_maps
+{
+    std::map<std::string, person::phone_type> ordered;      // = 1
+    std::unordered_map<std::uint64_t, person> hashed;         // = 2
+};
+
+ut::suite test_map_round_trip = [] {
+    using namespace boost::ut;
+
+    large_maps original;
+    for (int i = 0; i < 2000; ++i) {
+        original.ordered.emplace("phone " + std::to_string(i),
+                                 person::phone_type(i % 3));
+        original.hashed.emplace(i, person{.name = std::to_string(i),
+                                          .id = i});
+    }
+
+    auto [data, out] = zpp::proto::data_out();
+    out(original).or_throw();
+    expect(zpp::proto::message_size(original) == data.size());
+
+    large_maps decoded;
+    zpp::proto::in{data}(decoded).or_throw();
+    expect(decoded.ordered == original.ordered);
+    expect((decoded.hashed.size() == original.hashed.size()) >> fatal);
+    for (auto &[key, value] : original.hashed) {
+        expect(decoded.hashed.at(key).name == value.name);
+        expect(that % decoded.hashed.at(key).id == value.id);
+    }
+    expect(success(zpp::proto::validate<large_maps>(data)));
+};
+
+struct labeled_sample
+{
+    zpp::proto::interned_string region;                          // = 1
+    std::vector<zpp::proto::interned_string> labels;             // = 2
+    std::map<std::string, zpp::proto::interned_string> phones;   // = 3
+    double value;                                                // = 4
+};
+
+struct labeled_batch
+{
+    std::vector<labeled_sample> samples;
+};
+
+ut::suite test_interned_string = [] {
+    using namespace boost::ut;
+
+    labeled_batch batch;
+    for (int i = 0; i < 10; ++i) {
+        batch.samples.push_back(
+            {.region = i % 2 ? "eu-west" : "us-east",
+             .labels = {"home", "work"},
+             .phones = {{std::to_string(i), i % 2 ? "home" : "work"}},
+             .value = double(i)});
+    }
+    auto [data, out] = zpp::proto::data_out();
+    out(batch).or_throw();
+
+    zpp::proto::string_pool pool;
+    labeled_batch decoded;
+    zpp::proto::in{data, zpp::proto::intern{pool}}(decoded).or_throw();
+    expect((decoded.samples.size() == 10_u) >> fatal);
+    expect(pool.size() == 4_u);
+    for (std::size_t i = 0; i < decoded.samples.size(); ++i) {
+        auto &sample = decoded.samples[i];
+        expect(sample.region.view() == (i % 2 ? "eu-west" : "us-east"));
+        expect(sample.labels ==
+               std::vector<zpp::proto::interned_string>{"home", "work"});
+        expect(sample.phones.at(std::to_string(i)).view() ==
+               (i % 2 ? "home" : "work"));
+        expect(sample.value == double(i));
+    }
+    expect(decoded.samples[0].region.view().data() ==
+           decoded.samples[2].region.view().data());
+    expect(decoded.samples[0].labels[0].view().data() ==
+           decoded.samples[1].phones.at("1").view().data());
+
+    // Encodes like a std::string, decoding needs the intern option.
+    labeled_sample sample{.region = "us-east", .labels = {"home"}};
+    auto [sample_data, sample_out] = zpp::proto::data_out();
+    sample_out(sample).or_throw();
+    expect(to_hex(sample_data) == "0a0775732d656173741204686f6d65");
+    expect(zpp::proto::message_size(sample) == sample_data.size());
+    expect(success(zpp::proto::validate<labeled_sample>(sample_data)));
+    static_assert(sizeof(zpp::proto::in<std::span<const std::byte>>) <
+                  sizeof(zpp::proto::in<std::span<const std::byte>,
+                                        zpp::proto::intern>));
+};
+
+struct monster_columns
+{
+    using serialize = zpp::bits::protocol<zpp::bits::pb{}>;
+
+    monster::vec3 pos;
+    zpp::bits::vint32_t mana;
+    int hp;
+    std::string name;
+    std::vector<std::uint8_t> inventory;
+    enum monster::color color;
+    zpp::proto::columns<monster::weapon> weapons;
+    monster::weapon equipped;
+    zpp::proto::columns<monster::vec3> path;
+    bool boss;
+};
+
+struct reading
+{
+    float value;
+    bool valid;
+    std::vector<zpp::bits::vint32_t> flags;
+};
+
+struct readings
+{
+    std::vector<reading> values;
+};
+
+struct reading_columns
+{
+    zpp::proto::columns<reading> values;
+};
+
+ut::suite test_columns = [] {
+    using namespace boost::ut;
+
+    monster m = {.pos = {1.0, 2.0, 3.0},
+                 .name = "mushroom",
+                 .weapons = {monster::weapon{.name = "sword", .damage = 55},
+                             monster::weapon{.name = "spear", .damage = 150}},
+                 .path = {monster::vec3{2.0, 3.0, 4.0},
+                          monster::vec3{5.0, 6.0, 7.0},
+                          monster::vec3{8.0, 0.0, 10.0}},
+                 .boss = true};
+    auto [data, in, out] = zpp::proto::data_in_out();
+    out(m).or_throw();
+
+    monster_columns columns;
+    in(columns).or_throw();
+    expect(columns.name == "mushroom");
+    expect(columns.boss);
+    expect(columns.weapons.size() == 2_u);
+    expect(columns.weapons.column<0>() ==
+           std::vector<std::string>{"sword", "spear"});
+    expect(columns.weapons.field<2>() == std::vector<int>{55, 150});
+    expect((columns.path.size() == 3_u) >> fatal);
+    expect(columns.path.column<0>() == std::vector<float>{2.0, 5.0, 8.0});
+    expect(columns.path.column<1>() == std::vector<float>{3.0, 6.0, 0.0});
+    expect(columns.path.column<2>() == std::vector<float>{4.0, 7.0, 10.0});
+    expect(success(zpp::proto::validate<monster_columns>(data)));
+
+    // Decoding again replaces the columns.
+    in.position() = 0;
+    in(columns).or_throw();
+    expect(columns.path.size() == 3_u);
+
+    readings original{.values = {{.value = 1.5, .valid = true, .flags = {1, 2}},
+                                 {.value = 0.0, .valid = false},
+                                 {.value = -2.0, .valid = true, .flags = {3}}}};
+    auto [readings_data, readings_out] = zpp::proto::data_out();
+    readings_out(original).or_throw();
+
+    reading_columns values;
+    zpp::proto::in{readings_data}(values).or_throw();
+    expect((values.values.size() == 3_u) >> fatal);
+    expect(values.values.column<0>() == std::vector<float>{1.5, 0.0, -2.0});
+    expect(values.values.column<1>() == std::vector<bool>{true, false, true});
+    expect(values.values.column<2>() ==
+           std::vector<std::vector<zpp::bits::vint32_t>>{{1, 2}, {}, {3}});
+
+    reading_columns masked;
+    zpp::proto::in{readings_data,
+                   zpp::proto::field_mask<zpp::proto::field<
+                       1, zpp::proto::fields<2>>>{}}(masked)
+        .or_throw();
+    expect(masked.values.size() == 3_u);
+    expect(masked.values.column<0>() == std::vector<float>{0.0, 0.0, 0.0});
+    expect(masked.values.column<1>() == std::vector<bool>{true, false, true});
+};
+
+struct series
+{
+    std::vector<double> values;                   // = 1
+    std::vector<float> samples;                   // = 2
+    std::vector<int> levels;                      // = 3
+    std::vector<zpp::bits::vsint32_t> deltas;     // = 4
+    std::vector<zpp::bits::vuint64_t> counters;   // = 5
+    std::vector<std::uint8_t> inventory;          // = 6
+    zpp::bits::vint32_t total;                    // = 7
+    std::vector<std::byte> raw;                   // = 8
+};
+
+struct series_set
+{
+    std::vector<series> items;
+};
+
+ut::suite test_aggregate = [] {
+    using namespace boost::ut;
+
+    series s;
+    for (int i = 0; i < 1000; ++i) {
+        s.values.push_back(i * 0.5 - 100);
+        s.samples.push_back(float(i % 77) - 30);
+        s.levels.push_back(i * 3 - 1500);
+        s.deltas.push_back((i % 2 ? -1 : 1) * i);
+        s.counters.push_back(std::uint64_t(i % 10) << (i % 50));
+        s.inventory.push_back(std::uint8_t(i));
+        s.raw.push_back(std::byte(i % 200 + 20));
+    }
+    s.total = -7;
+    auto [data, out] = zpp::proto::data_out();
+    out(s).or_throw();
+
+    auto check = [&](auto stats, auto &values) {
+        using value_type =
+            typename std::remove_cvref_t<decltype(values)>::value_type;
+        typename decltype(stats)::sum_type sum{};
+        auto min = values.front();
+        auto max = values.front();
+        for (value_type value : values) {
+            sum += typename decltype(stats)::sum_type(value);
+            min = std::min(min, value);
+            max = std::max(max, value);
+        }
+        expect(stats.count == values.size());
+        expect(stats.sum == sum);
+        expect(stats.min == min);
+        expect(stats.max == max);
+    };
+
+    check(zpp::proto::aggregate<series, 1>(data).value(), s.values);
+    check(zpp::proto::aggregate<series, 2>(data).value(), s.samples);
+    check(zpp::proto::aggregate<series, 3>(data).value(), s.levels);
+    check(zpp::proto::aggregate<series, 4>(data).value(), s.deltas);
+    check(zpp::proto::aggregate<series, 5>(data).value(), s.counters);
+    check(zpp::proto::aggregate<series, 6>(data).value(), s.inventory);
+    check(zpp::proto::aggregate<series, 8>(data).value(), s.raw);
+
+    auto total = zpp::proto::aggregate<series, 7>(data).value();
+    expect(total.count == 1_u);
+    expect(total.sum == -7);
+
+    // Nested repeated messages accumulate, as do repeated calls.
+    series_set set{.items = {s, s}};
+    auto [set_data, set_out] = zpp::proto::data_out();
+    set_out(set).or_throw();
+    zpp::proto::field_stats_t<series_set, 1, 4> deltas;
+    expect(success(zpp::proto::aggregate<series_set, 1, 4>(set_data, deltas)));
+    expect(success(zpp::proto::aggregate<series, 4>(data, deltas)));
+    expect(deltas.count == 3000_u);
+    expect(deltas.min == -999);
+    expect(deltas.max == 998);
+
+    zpp::proto::field_stats<std::int32_t> empty;
+    expect(success(zpp::proto::aggregate<series, 3>(
+        std::span<const std::byte>{}, empty)));
+    expect(empty.count == 0_u);
+
+    data.resize(data.size() - 1);
+    expect(zpp::proto::aggregate<series, 8>(data).error() ==
+           std::errc::result_out_of_range);
+};
+
+ut::suite test_filter = [] {
+    using namespace boost::ut;
+    using zpp::proto::field_path;
+
+    auto [data, out] = zpp::proto::data_out(zpp::bits::size_varint{});
+    for (int i = 0; i < 100; ++i) {
+        out(person{.name = "person " + std::to_string(i),
+                   .id = i,
+                   .email = i % 10 ? "" : "ten@example.com",
+                   .phones = {{"555-" + std::to_string(i % 7),
+                               person::phone_type(i % 3)}}})
+            .or_throw();
+    }
+
+    expect(std::ranges::distance(zpp::proto::records(data)) == 100);
+
+    auto by_id = zpp::proto::filter<person>(data, field_path<2>{} == 42);
+    expect((std::ranges::distance(by_id) == 1) >> fatal);
+    person found;
+    zpp::proto::in{*by_id.begin()}(found).or_throw();
+    expect(found.name == "person 42");
+
+    std::vector<int> ids;
+    for (auto &&p : zpp::proto::filter_objects<person>(
+             data, field_path<2>{}.between(10, 40) &&
+                       field_path<3>{}.starts_with("ten"))) {
+        ids.push_back(p.id);
+    }
+    expect(ids == std::vector<int>{10, 20, 30, 40});
+
+    ids.clear();
+    for (auto &&p : zpp::proto::filter_objects<person>(
+             data, field_path<4, 1>{} == "555-6" ||
+                       field_path<4, 2>{} == person::work)) {
+        if (p.id < 20) {
+            ids.push_back(p.id);
+        }
+    }
+    expect(ids == std::vector<int>{2, 5, 6, 8, 11, 13, 14, 17});
+
+    expect(std::ranges::distance(
+               zpp::proto::filter<person>(data, field_path<2>{} >= 95)) == 5);
+    expect(std::ranges::distance(zpp::proto::filter<person>(
+               data, field_path<1>{}.starts_with("nobody"))) == 0);
+
+    // A truncated stream stops at the last complete record.
+    data.resize(data.size() - 1);
+    auto all = zpp::proto::filter<person>(data, field_path<2>{} != -1);
+    expect(std::ranges::distance(all) == 99);
+    expect(all.error() == std::errc::result_out_of_range);
+};
+
+struct timed_event
+{
+    double timestamp;    // = 1
+    std::string payload; // = 2
+};
+
+ut::suite test_sort_records = [] {
+    using namespace boost::ut;
+
+    auto [data, out] = zpp::proto::data_out(zpp::bits::size_varint{});
+    std::vector<person> people;
+    for (int i = 0; i < 500; ++i) {
+        people.push_back(person{.name = std::to_string(i),
+                                .id = (i * 37) % 101 - 50,
+                                .phones = {{"555", person::home}}});
+        out(people.back()).or_throw();
+    }
+    std::ranges::stable_sort(people, {}, [](auto &p) { return p.id.value; });
+
+    auto sort = [&](std::size_t run_size) {
+        std::stringstream input{
+            std::string{reinterpret_cast<const char *>(data.data()),
+                        data.size()}};
+        std::stringstream output;
+        expect(success(
+            zpp::proto::sort_records<person, 2>(input, output, run_size)));
+        auto sorted = output.str();
+        expect(sorted.size() == data.size());
+
+        std::vector<std::string> names;
+        for (auto record : zpp::proto::records(sorted)) {
+            person p;
+            zpp::proto::in{record}(p).or_throw();
+            names.push_back(p.name);
+        }
+        expect((names.size() == people.size()) >> fatal);
+        for (std::size_t i = 0; i < names.size(); ++i) {
+            expect(names[i] == people[i].name);
+        }
+    };
+    sort(1 << 20);
+    sort(256);
+
+    auto [event_data, event_out] =
+        zpp::proto::data_out(zpp::bits::size_varint{});
+    for (double timestamp : {3.5, -1.0, 0.0, -7.25, 2.0, 1e9, -1e9}) {
+        event_out(timed_event{timestamp, "x"}).or_throw();
+    }
+    std::stringstream input{std::string{
+        reinterpret_cast<const char *>(event_data.data()), event_data.size()}};
+    std::stringstream output;
+    expect(success(
+        zpp::proto::sort_records<timed_event, 1>(input, output, 32)));
+    std::vector<double> timestamps;
+    auto sorted = output.str();
+    for (auto record : zpp::proto::records(sorted)) {
+        timestamps.push_back(
+            zpp::proto::extract<timed_event, 1>(record).value());
+    }
+    expect(timestamps ==
+           std::vector<double>{-1e9, -7.25, -1.0, 0.0, 2.0, 3.5, 1e9});
+
+    std::stringstream truncated{std::string{
+        reinterpret_cast<const char *>(data.data()), data.size() - 1}};
+    std::stringstream ignored;
+    expect(zpp::proto::sort_records<person, 2>(truncated, ignored) ==
+           std::errc::result_out_of_range);
+
+    // a corrupt length prefix fails at the end of the input instead of
+    // allocating the length
+    std::stringstream corrupt{"\xff\xff\xff\xff\x0f\x08"};
+    expect(zpp::proto::sort_records<person, 2>(corrupt, ignored) ==
+           std::errc::result_out_of_range);
+    std::stringstream oversized{"\xff\xff\xff\xff\xff\xff\xff\xff\x7f\x08"};
+    expect(zpp::proto::sort_records<person, 2>(oversized, ignored) ==
+           std::errc::message_size);
+
+    // records larger than a read block, spilled and merged
+    auto [large_data, large_out] =
+        zpp::proto::data_out(zpp::bits::size_varint{});
+    for (int id : {3, 1, 2}) {
+        large_out(person{.name = std::string(100000 + id, 'a' + id), .id = id})
+            .or_throw();
+    }
+    std::stringstream large_input{std::string{
+        reinterpret_cast<const char *>(large_data.data()), large_data.size()}};
+    std::stringstream large_output;
+    expect(success(
+        zpp::proto::sort_records<person, 2>(large_input, large_output, 1)));
+    std::vector<int> ids;
+    auto large_sorted = large_output.str();
+    for (auto record : zpp::proto::records(large_sorted)) {
+        person p;
+        zpp::proto::in{record}(p).or_throw();
+        expect(p.name == std::string(100000 + p.id, 'a' + p.id));
+        ids.push_back(p.id);
+    }
+    expect(ids == std::vector{1, 2, 3});
+};
+
 int
 main()
 {
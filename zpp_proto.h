@@ -1,6 +1,22 @@
 #ifndef ZPP_PROTO_H
 #define ZPP_PROTO_H
 
+#include <iterator>
+#include <ranges>
+#include <cstdio>
+#include <exception>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <queue>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+
+#if defined __AVX2__ || defined __SSE2__
+#include <immintrin.h>
+#endif
+
 namespace zpp
 {
 namespace proto
@@ -38,6 +54,36 @@ template <typename T>
 concept is_length_delimited = !std::is_fundamental_v<T> &&
     !std::same_as<std::byte, T> &&
     !bits::concepts::varint<T>;
+
+template <typename T>
+concept cached_message = requires { typename T::cached_type; };
+
+template <typename T>
+concept pre_encoded_message = requires { typename T::pre_encoded_type; };
+
+template <typename T>
+concept sink_field = requires { typename T::sink_type; };
+
+template <typename T>
+concept interned_field = requires { typename T::interned_type; };
+
+template <typename T>
+concept columns_field = requires { typename T::columns_type; };
+
+template <typename Type>
+concept bytes_field = bits::concepts::container<Type> &&
+    (std::same_as<typename Type::value_type, char> ||
+     std::same_as<typename Type::value_type, unsigned char> ||
+     std::same_as<typename Type::value_type, std::byte>);
+
+template <typename Type>
+concept repeated_field = bits::concepts::container<Type> && !bytes_field<Type>;
+
+// A range that is not a container, such as a view or a generator, encoded
+// as a repeated field.
+template <typename T>
+concept encodable_range = std::ranges::input_range<T> &&
+    !bits::concepts::container<std::remove_cvref_t<T>>;
 } // namespace concepts
 
 template <typename Type>
@@ -47,6 +93,17 @@ constexpr auto check_type()
     if constexpr (!std::is_class_v<type> || bits::concepts::varint<type> ||
                   bits::concepts::empty<type>) {
         return true;
+    } else if constexpr (concepts::cached_message<type> ||
+                         concepts::pre_encoded_message<type> ||
+                         concepts::sink_field<type> ||
+                         concepts::columns_field<type>) {
+        static_assert(check_type<typename type::value_type>());
+        return true;
+    } else if constexpr (concepts::interned_field<type>) {
+        return true;
+    } else if constexpr (concepts::encodable_range<type>) {
+        static_assert(check_type<std::ranges::range_value_t<type>>());
+        return true;
     } else if constexpr (bits::concepts::associative_container<type> &&
                          requires { typename type::mapped_type; }) {
         static_assert(
@@ -86,6 +143,22 @@ enum class wire_type : unsigned int
     fixed_32 = 5,
 };
 
+// The integer a varint member is decoded into, which bounds its size.
+template <typename Type>
+constexpr auto varint_value()
+{
+    if constexpr (bits::concepts::varint<Type>) {
+        return varint_value<typename Type::value_type>();
+    } else if constexpr (std::is_enum_v<Type>) {
+        return std::type_identity<std::underlying_type_t<Type>>{};
+    } else {
+        return std::type_identity<Type>{};
+    }
+}
+
+template <typename Type>
+using varint_value_t = typename decltype(varint_value<Type>())::type;
+
 template <typename Type>
 constexpr auto tag_type()
 {
@@ -139,765 +212,5202 @@ constexpr auto field_num()
     return field_numbers(( Type * ) nullptr)[Index];
 }
 
-namespace traits
+template <typename Type>
+constexpr auto member_types()
 {
+    return bits::visit_members_types<Type>([]<typename... Types>() {
+        return std::type_identity<std::tuple<std::remove_cvref_t<Types>...>>{};
+    });
+}
 
-constexpr auto get_default_size_type()
+template <typename Type, std::size_t Index>
+using member_type_t =
+    std::tuple_element_t<Index, typename decltype(member_types<Type>())::type>;
+
+template <typename Type, auto FieldNumber, std::size_t Index = 0>
+constexpr std::size_t member_index()
 {
-    return std::monostate{};
+    if constexpr (Index >= bits::number_of_members<Type>()) {
+        static_assert(!sizeof(Type), "no member with this field number");
+        return Index;
+    } else if constexpr (field_num<Type, Index>() == FieldNumber) {
+        return Index;
+    } else {
+        return member_index<Type, FieldNumber, Index + 1>();
+    }
 }
 
-constexpr auto get_default_size_type(auto option, auto... options)
+template <typename Type>
+using map_key_t = std::conditional_t<
+    std::is_enum_v<typename Type::key_type> &&
+        !std::same_as<typename Type::key_type, std::byte>,
+    bits::varint<typename Type::key_type>, typename Type::key_type>;
+
+template <typename Type>
+using map_mapped_t = std::conditional_t<
+    std::is_enum_v<typename Type::mapped_type> &&
+        !std::same_as<typename Type::mapped_type, std::byte>,
+    bits::varint<typename Type::mapped_type>, typename Type::mapped_type>;
+
+// The wire representation of a single map entry: key = 1, value = 2.
+template <typename Type>
+struct map_entry
 {
-    if constexpr (requires { typename decltype(option)::default_size_type; }) {
-        if constexpr (std::is_void_v<
-                          typename decltype(option)::default_size_type>) {
-            return std::monostate{};
+    map_key_t<Type> key;
+    map_mapped_t<Type> value;
+};
+
+// A decode-only repeated field that hands every element to callback as it
+// is decoded, instead of storing it. Elements are decoded into one scratch
+// object that is reused, so memory stays bounded by a single element. The
+// callback takes the element by reference and may return an errc to stop
+// decoding.
+template <typename Type, typename Callback>
+class sink
+{
+public:
+    static_assert(concepts::is_length_delimited<Type> && !std::is_enum_v<Type>,
+                  "packed scalars cannot be sunk element by element");
+
+    using value_type = Type;
+    using sink_type = Type;
+
+    sink() = default;
+
+    sink(Callback callback) : m_callback(std::move(callback))
+    {
+    }
+
+    Type &scratch()
+    {
+        return m_scratch;
+    }
+
+    bits::errc consume()
+    {
+        ++m_count;
+        if constexpr (std::same_as<decltype(m_callback(m_scratch)),
+                                   bits::errc>) {
+            return m_callback(m_scratch);
         } else {
-            return typename decltype(option)::default_size_type{};
+            m_callback(m_scratch);
+            return {};
         }
-    } else {
-        return get_default_size_type(options...);
     }
-}
 
-template <typename... Options>
-using default_size_type_t = std::conditional_t<
-    std::same_as<std::monostate,
-                 decltype(get_default_size_type(std::declval<Options>()...))>,
-    void, decltype(get_default_size_type(std::declval<Options>()...))>;
-} // namespace traits
+    // The number of elements passed to the callback.
+    std::size_t count() const
+    {
+        return m_count;
+    }
 
-template <bits::concepts::byte_view ByteView, typename... Options>
-constexpr auto make_out_archive(ByteView &&view, Options &&...options)
+private:
+    Callback m_callback{};
+    Type m_scratch{};
+    std::size_t m_count = 0;
+};
+
+// A decode-only repeated message field stored as one vector per member of
+// Type (struct of arrays): column<Index>() holds member Index of every
+// element, in order. Members absent from an element are value initialized.
+template <typename Type>
+class columns
 {
-    constexpr auto enlarger = bits::traits::enlarger<Options...>();
-    constexpr auto no_enlarge_overflow =
-        (... || std::same_as<std::remove_cvref_t<Options>, bits::options::no_enlarge_overflow>);
+    static_assert(std::is_class_v<Type>, "columns need a message type");
 
-    return bits::out{
-        std::forward<ByteView>(view),
-        bits::size_varint{},
-        bits::no_fit_size{},
-        bits::endian::little{},
-        bits::enlarger<std::get<0>(enlarger), std::get<1>(enlarger)>{},
-        std::conditional_t<no_enlarge_overflow, bits::no_enlarge_overflow,
-                           bits::enlarge_overflow>{},
-        bits::alloc_limit<bits::traits::alloc_limit<Options...>()>{}};
-}
+    template <std::size_t... Indices>
+    static auto make_columns(std::index_sequence<Indices...>)
+        -> std::tuple<std::vector<member_type_t<Type, Indices>>...>;
 
-template <bits::concepts::byte_view ByteView = std::vector<std::byte>,
-          typename... Options>
-struct out
-{
-    using archive_type = decltype(make_out_archive(
-        std::declval<ByteView &>(), std::declval<Options &&>()...));
+public:
+    using value_type = Type;
+    using columns_type = Type;
+    using tuple_type = decltype(make_columns(
+        std::make_index_sequence<bits::number_of_members<Type>()>{}));
 
-    archive_type m_archive;
+    template <std::size_t Index>
+    auto &column()
+    {
+        return std::get<Index>(m_columns);
+    }
 
-    using default_size_type = traits::default_size_type_t<Options...>;
+    template <std::size_t Index>
+    const auto &column() const
+    {
+        return std::get<Index>(m_columns);
+    }
 
-    constexpr explicit out(ByteView &&view, Options &&...options) :
-        m_archive(make_out_archive(std::move(view),
-                                   std::forward<Options>(options)...))
-    {}
+    template <auto FieldNumber>
+    auto &field()
+    {
+        return column<member_index<Type, FieldNumber>()>();
+    }
 
-    constexpr explicit out(ByteView &view, Options &&...options) :
-        m_archive(make_out_archive(view, std::forward<Options>(options)...))
-    {}
+    template <auto FieldNumber>
+    const auto &field() const
+    {
+        return column<member_index<Type, FieldNumber>()>();
+    }
 
-    constexpr static auto kind()
+    std::size_t size() const
     {
-        return bits::kind::out;
+        return m_size;
     }
-    constexpr static bool resizable = archive_type::resizable;
 
-    constexpr std::size_t
-    position() const
+    bool empty() const
     {
-        return m_archive.position();
+        return !m_size;
     }
 
-    constexpr std::size_t &position()
+    void reserve(std::size_t size)
     {
-        return m_archive.position();
+        std::apply([&](auto &...columns) { (columns.reserve(size), ...); },
+                   m_columns);
     }
 
-    constexpr auto remaining_data()
+    void clear()
     {
-        return m_archive.remaining_data();
+        std::apply([](auto &...columns) { (columns.clear(), ...); },
+                   m_columns);
+        m_size = 0;
     }
 
-    constexpr static auto no_fit_size =
-        (... ||
-         std::same_as<std::remove_cvref_t<Options>, bits::options::no_fit_size>);
+    // Appends a value initialized element, its fields are then decoded into
+    // the back of each column.
+    void push_back()
+    {
+        std::apply([](auto &...columns) { (columns.emplace_back(), ...); },
+                   m_columns);
+        ++m_size;
+    }
 
-    constexpr auto ZPP_BITS_INLINE operator()(auto &&item)
+private:
+    tuple_type m_columns;
+    std::size_t m_size = 0;
+};
+
+// A sub-message member that keeps its last encoded bytes, out writes them
+// back with a single copy until the value is changed through modify() or
+// set(). modify() only lends the value to a callback, so a reference to
+// it must not be kept past the call. Decoding keeps the received bytes as
+// well, unless a field mask skipped part of the message. Encoding a const
+// cached stores the bytes through the mutable members, so a cached value
+// must not be encoded from several threads at once while it is dirty.
+template <typename Type>
+class cached
+{
+public:
+    using value_type = Type;
+    using cached_type = Type;
+
+    cached() = default;
+
+    cached(Type value) : m_value(std::move(value))
     {
-        if constexpr (archive_type::resizable && !no_fit_size &&
-                      archive_type::enlarger != std::tuple{1, 1}) {
-            auto end = m_archive.data().size();
-            auto result =
-                serialize_one<default_size_type>(std::forward<decltype(item)>(item));
-            if (m_archive.position() >= end) {
-                m_archive.data().resize(m_archive.position());
-            }
-            return result;
-        } else {
-            return serialize_one<default_size_type>(
-                std::forward<decltype(item)>(item));
-        }
     }
 
-    constexpr auto ZPP_BITS_INLINE serialize_unsized(auto &&item)
+    const Type &get() const
     {
-        using type = std::remove_cvref_t<decltype(item)>;
-        static_assert(check_type<type>());
+        return m_value;
+    }
 
-        if constexpr (bits::concepts::self_referencing<type>) {
-            return bits::visit_members(
-                std::forward<decltype(item)>(item), [&](auto &&...items) constexpr {
-                    static_assert((... && check_type<decltype(items)>()));
-                    return serialize_many<type>(
-                        std::make_index_sequence<sizeof...(items)>{},
-                        std::forward<decltype(items)>(items)...);
-                });
-        } else {
-            return bits::visit_members(
-                item, [&](auto &&...items) ZPP_BITS_CONSTEXPR_INLINE_LAMBDA {
-                    static_assert((... && check_type<decltype(items)>()));
-                    return serialize_many<type>(
-                        std::make_index_sequence<sizeof...(items)>{},
-                        std::forward<decltype(items)>(items)...);
-                });
+    // Calls function with the value, which is then encoded again.
+    decltype(auto) modify(auto &&function)
+    {
+        m_dirty = true;
+        return std::forward<decltype(function)>(function)(m_value);
+    }
+
+    void set(Type value)
+    {
+        m_value = std::move(value);
+        m_dirty = true;
+    }
+
+    bool dirty() const
+    {
+        return m_dirty;
+    }
+
+    // The encoded bytes of the value without the length prefix, only
+    // meaningful when the value is not dirty.
+    std::span<const std::byte> bytes() const
+    {
+        return m_bytes;
+    }
+
+    void store_bytes(const auto *data, std::size_t size) const
+    {
+        m_bytes.resize(size);
+        if (size) {
+            std::memcpy(m_bytes.data(), data, size);
         }
+        m_dirty = false;
     }
 
-    template <typename TagType, std::size_t FirstIndex, std::size_t... Indices>
-    constexpr auto ZPP_BITS_INLINE
-    serialize_many(std::index_sequence<FirstIndex, Indices...>, auto &&first_item,
-                   auto &&...items)
+private:
+    Type m_value{};
+    mutable std::vector<std::byte> m_bytes;
+    mutable bool m_dirty = true;
+};
+
+// Owns one copy of every distinct string interned into it, decoding an
+// interned_string member with the pool looks the wire bytes up instead of
+// allocating. Interned strings keep their address until clear() or the
+// pool is destroyed. Not thread safe.
+class string_pool
+{
+public:
+    std::string_view intern(std::string_view value)
     {
-        if (auto result = serialize_field<field_num<TagType, FirstIndex>()>(
-                std::forward<decltype(first_item)>(first_item));
-            failure(result)) [[unlikely]] {
-            return result;
+        if (auto it = m_strings.find(value); it != m_strings.end()) {
+            return *it;
         }
+        return *m_strings.emplace(value).first;
+    }
 
-        return serialize_many<TagType>(std::index_sequence<Indices...>{},
-                                       std::forward<decltype(items)>(items)...);
+    std::size_t size() const
+    {
+        return m_strings.size();
     }
 
-    template <typename TagType>
-    constexpr bits::errc ZPP_BITS_INLINE serialize_many(std::index_sequence<>)
+    void clear()
     {
-        return {};
+        m_strings.clear();
     }
 
-    template <auto FieldNum, typename TagType = void>
-    constexpr bits::errc ZPP_BITS_INLINE serialize_field(auto &&item)
+private:
+    struct hash
     {
-        using type = std::remove_cvref_t<decltype(item)>;
-        using tag_type = std::conditional_t<std::is_void_v<TagType>, type, TagType>;
+        using is_transparent = void;
 
-        if constexpr (bits::concepts::empty<type>) {
-            return {};
-        } else if constexpr (std::is_enum_v<type> &&
-                             !std::same_as<type, std::byte>) {
-            constexpr auto tag = make_tag<tag_type>(FieldNum);
-            if (auto result =
-                    m_archive(tag, bits::varint{std::underlying_type_t<type>(std::forward<decltype(item)>(item))});
-                failure(result)) [[unlikely]] {
-                return result;
-            }
-            return {};
-        } else if constexpr (!concepts::is_length_delimited<type>) {
-            constexpr auto tag = make_tag<tag_type>(FieldNum);
-            if (item != 0)
-                return m_archive(tag, std::forward<decltype(item)>(item));
-            return {};
-        } else if constexpr (requires { type::serialize(*this, item); }) {
-            return type::serialize(*this, std::forward<decltype(item)>(item));
-        } else if constexpr (requires { serialize(*this, item); }) {
-            return serialize(*this, std::forward<decltype(item)>(item));
-        } else if constexpr (bits::concepts::optional<type>) {
-            if (item.has_value()) {
-                return serialize_field<FieldNum, TagType>(*item);
-            }
-            return {};
-        } else if constexpr (!bits::concepts::container<type>) {
-            constexpr auto tag = make_tag<tag_type>(FieldNum);
-            if (auto result = m_archive(tag); failure(result)) [[unlikely]] {
-                return result;
-            }
-            return serialize_sized(std::forward<decltype(item)>(item));
-        } else if constexpr (bits::concepts::associative_container<type> &&
-                             requires { typename type::mapped_type; }) {
-            constexpr auto tag = make_tag<tag_type>(FieldNum);
+        std::size_t operator()(std::string_view value) const
+        {
+            return std::hash<std::string_view>{}(value);
+        }
+    };
 
-            using key_type = std::conditional_t<
-                std::is_enum_v<typename type::key_type> &&
-                    !std::same_as<typename type::key_type, std::byte>,
-                bits::varint<typename type::key_type>, typename type::key_type>;
+    std::unordered_set<std::string, hash, std::equal_to<>> m_strings;
+};
 
-            using mapped_type = std::conditional_t<
-                std::is_enum_v<typename type::mapped_type> &&
-                    !std::same_as<typename type::mapped_type, std::byte>,
-                bits::varint<typename type::mapped_type>, typename type::mapped_type>;
+// A string member that refers to a string it does not own, decoded through
+// the string_pool given to in with the intern option. Encodes like a
+// std::string.
+class interned_string
+{
+public:
+    using interned_type = std::string_view;
 
-            struct value_type
-            {
-                const key_type &key;
-                const mapped_type &value;
-            };
+    constexpr interned_string() = default;
 
-            for (auto &[key, value] : item) {
-                if (auto result = m_archive(tag); failure(result)) [[unlikely]] {
-                    return serialize_sized(value_type{.key = key, .value = value});
-                }
-            }
+    constexpr interned_string(std::string_view value) : m_value(value)
+    {
+    }
+
+    constexpr interned_string(const char *value) : m_value(value)
+    {
+    }
+
+    constexpr std::string_view view() const
+    {
+        return m_value;
+    }
+
+    constexpr operator std::string_view() const
+    {
+        return m_value;
+    }
+
+    constexpr bool empty() const
+    {
+        return m_value.empty();
+    }
+
+    constexpr std::size_t size() const
+    {
+        return m_value.size();
+    }
+
+    friend constexpr bool operator==(interned_string, interned_string) = default;
+
+    friend constexpr auto operator<=>(interned_string left,
+                                      interned_string right)
+    {
+        return left.m_value <=> right.m_value;
+    }
+
+private:
+    std::string_view m_value;
+};
+
+// Selects the field with the given number, Mask optionally restricts the
+// fields decoded from the selected sub-message.
+template <std::uint32_t FieldNumber, typename Mask = void>
+struct field
+{
+    using mask_type = Mask;
+
+    template <typename Type, std::size_t Index>
+    constexpr static bool selects()
+    {
+        return std::uint32_t(field_num<Type, Index>()) == FieldNumber;
+    }
+};
+
+// Selects the member with the given index, see field.
+template <std::size_t MemberIndex, typename Mask = void>
+struct member
+{
+    using mask_type = Mask;
+
+    template <typename Type, std::size_t Index>
+    constexpr static bool selects()
+    {
+        return Index == MemberIndex;
+    }
+};
+
+template <typename Mask, typename Type, std::size_t Index>
+constexpr bool mask_selects()
+{
+    if constexpr (std::is_void_v<Mask>) {
+        return true;
+    } else {
+        return Mask::template selects<Type, Index>();
+    }
+}
+
+template <typename Mask, typename Type, std::size_t Index>
+constexpr auto sub_mask()
+{
+    if constexpr (std::is_void_v<Mask>) {
+        return std::type_identity<void>{};
+    } else {
+        return Mask::template sub_mask<Type, Index>();
+    }
+}
+
+template <typename Mask, typename Type, std::size_t Index>
+using sub_mask_t = typename decltype(sub_mask<Mask, Type, Index>())::type;
+
+// Selects what Mask selects (void for every field) except the field with
+// the given number, with the sub-masks of Mask.
+template <typename Mask, std::uint32_t FieldNumber>
+struct without_field
+{
+    template <typename Type, std::size_t Index>
+    constexpr static bool selects()
+    {
+        return mask_selects<Mask, Type, Index>() &&
+               std::uint32_t(field_num<Type, Index>()) != FieldNumber;
+    }
+
+    template <typename Type, std::size_t Index>
+    constexpr static auto sub_mask()
+    {
+        return proto::sub_mask<Mask, Type, Index>();
+    }
+};
+
+namespace traits
+{
+
+constexpr auto get_default_size_type()
+{
+    return std::monostate{};
+}
+
+constexpr auto get_default_size_type(auto option, auto... options)
+{
+    if constexpr (requires { typename decltype(option)::default_size_type; }) {
+        if constexpr (std::is_void_v<
+                          typename decltype(option)::default_size_type>) {
+            return std::monostate{};
+        } else {
+            return typename decltype(option)::default_size_type{};
+        }
+    } else {
+        return get_default_size_type(options...);
+    }
+}
+
+template <typename... Options>
+using default_size_type_t = std::conditional_t<
+    std::same_as<std::monostate,
+                 decltype(get_default_size_type(std::declval<Options>()...))>,
+    void, decltype(get_default_size_type(std::declval<Options>()...))>;
+
+template <typename Option, typename... Options>
+constexpr auto has_option()
+{
+    return (... || std::same_as<std::remove_cvref_t<Options>, Option>);
+}
+
+template <typename Option, typename... Options>
+constexpr std::size_t get_padding()
+{
+    if constexpr (requires { std::remove_cvref_t<Option>::padding_value; }) {
+        return std::remove_cvref_t<Option>::padding_value;
+    } else if constexpr (sizeof...(Options) != 0) {
+        return get_padding<Options...>();
+    } else {
+        return 0;
+    }
+}
+
+template <typename... Options>
+constexpr std::size_t padding()
+{
+    if constexpr (sizeof...(Options) != 0) {
+        return get_padding<Options...>();
+    } else {
+        return 0;
+    }
+}
+
+template <typename Option, typename... Options>
+constexpr auto get_field_mask()
+{
+    if constexpr (requires {
+                      typename std::remove_cvref_t<Option>::field_mask_type;
+                  }) {
+        return std::type_identity<
+            typename std::remove_cvref_t<Option>::field_mask_type>{};
+    } else if constexpr (sizeof...(Options) != 0) {
+        return get_field_mask<Options...>();
+    } else {
+        return std::type_identity<void>{};
+    }
+}
+
+template <typename... Options>
+constexpr auto field_mask()
+{
+    if constexpr (sizeof...(Options) != 0) {
+        return get_field_mask<Options...>();
+    } else {
+        return std::type_identity<void>{};
+    }
+}
+
+template <typename... Options>
+using field_mask_t = typename decltype(field_mask<Options...>())::type;
+
+template <typename Option, typename... Options>
+constexpr auto get_parallel()
+{
+    if constexpr (requires {
+                      std::remove_cvref_t<Option>::parallel_threshold;
+                  }) {
+        return std::type_identity<std::remove_cvref_t<Option>>{};
+    } else if constexpr (sizeof...(Options) != 0) {
+        return get_parallel<Options...>();
+    } else {
+        return std::type_identity<void>{};
+    }
+}
+
+template <typename... Options>
+constexpr auto parallel()
+{
+    if constexpr (sizeof...(Options) != 0) {
+        return get_parallel<Options...>();
+    } else {
+        return std::type_identity<void>{};
+    }
+}
+
+template <typename... Options>
+using parallel_t = typename decltype(parallel<Options...>())::type;
+} // namespace traits
+
+inline namespace options
+{
+// The input was produced by a trusted encoder (or checked once with
+// validate<Type>()), per-field bounds checks are compiled out.
+struct trusted : bits::option<trusted>
+{
+};
+
+// The caller guarantees that Size bytes past the end of the input are
+// readable, varints and fixed-width fields are then always loaded without
+// a size check, and positions are checked against the end after each tag
+// and each field, so no single read starts past the end.
+template <std::size_t Size = 16>
+struct padded : bits::option<padded<Size>>
+{
+    static_assert(Size >= bits::varint_max_size<std::uint64_t>);
+    constexpr static auto padding_value = Size;
+};
+
+// Decodes only the selected fields (field<Number> or member<Index>), the
+// rest are skipped on the wire and their members are left untouched.
+template <typename... Fields>
+struct field_mask : bits::option<field_mask<Fields...>>
+{
+    using field_mask_type = field_mask;
+
+    template <typename Type, std::size_t Index>
+    constexpr static bool selects()
+    {
+        return (... || Fields::template selects<Type, Index>());
+    }
+
+    template <typename Type, std::size_t Index, typename Field,
+              typename... OtherFields>
+    constexpr static auto find_sub_mask()
+    {
+        if constexpr (Field::template selects<Type, Index>()) {
+            return std::type_identity<typename Field::mask_type>{};
+        } else if constexpr (sizeof...(OtherFields) != 0) {
+            return find_sub_mask<Type, Index, OtherFields...>();
+        } else {
+            return std::type_identity<void>{};
+        }
+    }
+
+    template <typename Type, std::size_t Index>
+    constexpr static auto sub_mask()
+    {
+        if constexpr (sizeof...(Fields) != 0) {
+            return find_sub_mask<Type, Index, Fields...>();
+        } else {
+            return std::type_identity<void>{};
+        }
+    }
+};
+
+template <std::uint32_t... FieldNumbers>
+using fields = field_mask<field<FieldNumbers>...>;
+
+template <std::size_t... Indices>
+using members = field_mask<member<Indices>...>;
+
+// Decodes with Mask (void for every field) in place of any field_mask
+// option that follows it.
+template <typename Mask>
+struct use_field_mask : bits::option<use_field_mask<Mask>>
+{
+    using field_mask_type = Mask;
+};
+
+// Repeated message fields are split across Threads threads (0 for the
+// hardware concurrency) when the input is at least Threshold bytes.
+template <std::size_t Threshold = (1 << 20), unsigned Threads = 0>
+struct parallel : bits::option<parallel<Threshold, Threads>>
+{
+    constexpr static auto parallel_threshold = Threshold;
+    constexpr static auto parallel_threads = Threads;
+
+    static unsigned threads(std::size_t work)
+    {
+        std::size_t count = Threads ? Threads : std::thread::hardware_concurrency();
+        return unsigned(std::clamp<std::size_t>(count, 1, std::max<std::size_t>(work, 1)));
+    }
+
+    // Runs task(begin, end) over [0, work) split in contiguous chunks, one
+    // per thread, the first failure in chunk order is returned.
+    static bits::errc run(std::size_t work, auto &&task)
+    {
+        auto count = threads(work);
+        std::vector<bits::errc> results(count);
+        std::vector<std::exception_ptr> exceptions(count);
+        auto chunk = [&](std::size_t index) {
+            try {
+                results[index] = task(work * index / count,
+                                      work * (index + 1) / count);
+            } catch (...) {
+                exceptions[index] = std::current_exception();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        workers.reserve(count - 1);
+        for (std::size_t index = 1; index < count; ++index) {
+            workers.emplace_back(chunk, index);
+        }
+        chunk(0);
+        for (auto &worker : workers) {
+            worker.join();
+        }
+
+        for (std::size_t index = 0; index < count; ++index) {
+            if (exceptions[index]) {
+                std::rethrow_exception(exceptions[index]);
+            }
+            if (failure(results[index])) {
+                return results[index];
+            }
+        }
+        return {};
+    }
+};
+
+// Decodes interned_string members through pool.
+struct intern : bits::option<intern>
+{
+    constexpr explicit intern(string_pool &pool) : pool(&pool)
+    {
+    }
+
+    string_pool *pool;
+};
+} // namespace options
+
+template <bits::concepts::byte_view ByteView, typename... Options>
+constexpr auto make_out_archive(ByteView &&view, Options &&...options)
+{
+    constexpr auto enlarger = bits::traits::enlarger<Options...>();
+    constexpr auto no_enlarge_overflow =
+        (... || std::same_as<std::remove_cvref_t<Options>, bits::options::no_enlarge_overflow>);
+
+    return bits::out{
+        std::forward<ByteView>(view),
+        bits::size_varint{},
+        bits::no_fit_size{},
+        bits::endian::little{},
+        bits::enlarger<std::get<0>(enlarger), std::get<1>(enlarger)>{},
+        std::conditional_t<no_enlarge_overflow, bits::no_enlarge_overflow,
+                           bits::enlarge_overflow>{},
+        bits::alloc_limit<bits::traits::alloc_limit<Options...>()>{}};
+}
+
+template <typename Type>
+constexpr std::size_t message_size(const Type &item);
+
+template <typename Type>
+constexpr std::size_t message_size(const Type &item, bits::errc &error);
+
+template <auto FieldNum, typename TagType = void>
+constexpr std::size_t field_size(const auto &item);
+
+template <auto FieldNum, typename TagType = void>
+constexpr std::size_t field_size(const auto &item, bits::errc &error);
+
+// A map key or value as it is encoded in its entry, enums as varints.
+template <typename Type>
+constexpr decltype(auto) map_entry_field(const Type &value)
+{
+    if constexpr (std::is_enum_v<Type> && !std::same_as<Type, std::byte>) {
+        return bits::varint<Type>{value};
+    } else {
+        return value;
+    }
+}
+
+constexpr std::size_t length_delimited_size(std::size_t size)
+{
+    return bits::varint_size(size) + size;
+}
+
+template <bits::concepts::byte_view ByteView = std::vector<std::byte>,
+          typename... Options>
+struct out
+{
+    using archive_type = decltype(make_out_archive(
+        std::declval<ByteView &>(), std::declval<Options &&>()...));
+
+    archive_type m_archive;
+
+    using default_size_type = traits::default_size_type_t<Options...>;
+
+    using parallel_type = traits::parallel_t<Options...>;
+
+    constexpr explicit out(ByteView &&view, Options &&...options) :
+        m_archive(make_out_archive(std::move(view),
+                                   std::forward<Options>(options)...))
+    {}
+
+    constexpr explicit out(ByteView &view, Options &&...options) :
+        m_archive(make_out_archive(view, std::forward<Options>(options)...))
+    {}
+
+    constexpr static auto kind()
+    {
+        return bits::kind::out;
+    }
+    constexpr static bool resizable = archive_type::resizable;
+
+    constexpr std::size_t
+    position() const
+    {
+        return m_archive.position();
+    }
+
+    constexpr std::size_t &position()
+    {
+        return m_archive.position();
+    }
+
+    constexpr auto remaining_data()
+    {
+        return m_archive.remaining_data();
+    }
+
+    constexpr static auto no_fit_size =
+        (... ||
+         std::same_as<std::remove_cvref_t<Options>, bits::options::no_fit_size>);
+
+    constexpr auto ZPP_BITS_INLINE operator()(auto &&item)
+    {
+        if constexpr (archive_type::resizable && !no_fit_size &&
+                      archive_type::enlarger != std::tuple{1, 1}) {
+            auto end = m_archive.data().size();
+            auto result =
+                serialize_one<default_size_type>(std::forward<decltype(item)>(item));
+            if (m_archive.position() >= end) {
+                m_archive.data().resize(m_archive.position());
+            }
+            return result;
+        } else {
+            return serialize_one<default_size_type>(
+                std::forward<decltype(item)>(item));
+        }
+    }
+
+    constexpr auto ZPP_BITS_INLINE serialize_unsized(auto &&item)
+    {
+        using type = std::remove_cvref_t<decltype(item)>;
+        static_assert(check_type<type>());
+
+        if constexpr (bits::concepts::self_referencing<type>) {
+            return bits::visit_members(
+                std::forward<decltype(item)>(item), [&](auto &&...items) constexpr {
+                    static_assert((... && check_type<decltype(items)>()));
+                    return serialize_many<type>(
+                        std::make_index_sequence<sizeof...(items)>{},
+                        std::forward<decltype(items)>(items)...);
+                });
+        } else {
+            return bits::visit_members(
+                item, [&](auto &&...items) ZPP_BITS_CONSTEXPR_INLINE_LAMBDA {
+                    static_assert((... && check_type<decltype(items)>()));
+                    return serialize_many<type>(
+                        std::make_index_sequence<sizeof...(items)>{},
+                        std::forward<decltype(items)>(items)...);
+                });
+        }
+    }
+
+    template <typename TagType, std::size_t FirstIndex, std::size_t... Indices>
+    constexpr auto ZPP_BITS_INLINE
+    serialize_many(std::index_sequence<FirstIndex, Indices...>, auto &&first_item,
+                   auto &&...items)
+    {
+        if (auto result = serialize_field<field_num<TagType, FirstIndex>()>(
+                std::forward<decltype(first_item)>(first_item));
+            failure(result)) [[unlikely]] {
+            return result;
+        }
+
+        return serialize_many<TagType>(std::index_sequence<Indices...>{},
+                                       std::forward<decltype(items)>(items)...);
+    }
+
+    template <typename TagType>
+    constexpr bits::errc ZPP_BITS_INLINE serialize_many(std::index_sequence<>)
+    {
+        return {};
+    }
+
+    template <auto FieldNum, typename TagType = void>
+    constexpr bits::errc ZPP_BITS_INLINE serialize_field(auto &&item)
+    {
+        using type = std::remove_cvref_t<decltype(item)>;
+        using tag_type = std::conditional_t<std::is_void_v<TagType>, type, TagType>;
+
+        if constexpr (bits::concepts::empty<type>) {
+            return {};
+        } else if constexpr (std::is_enum_v<type> &&
+                             !std::same_as<type, std::byte>) {
+            constexpr auto tag = make_tag<tag_type>(FieldNum);
+            if (auto result =
+                    m_archive(tag, bits::varint{std::underlying_type_t<type>(std::forward<decltype(item)>(item))});
+                failure(result)) [[unlikely]] {
+                return result;
+            }
+            return {};
+        } else if constexpr (!concepts::is_length_delimited<type>) {
+            constexpr auto tag = make_tag<tag_type>(FieldNum);
+            if (item != 0)
+                return m_archive(tag, std::forward<decltype(item)>(item));
+            return {};
+        } else if constexpr (concepts::pre_encoded_message<type>) {
+            constexpr auto tag = make_tag<tag_type>(FieldNum);
+            return m_archive(tag, bits::unsized(item.encoded()));
+        } else if constexpr (concepts::interned_field<type>) {
+            constexpr auto tag = make_tag<tag_type>(FieldNum);
+            if (item.empty()) {
+                return {};
+            }
+            return m_archive(tag, bits::varint{item.size()},
+                             bits::unsized(item.view()));
+        } else if constexpr (concepts::cached_message<type>) {
+            constexpr auto tag = make_tag<tag_type>(FieldNum);
+            if (auto result = m_archive(tag); failure(result)) [[unlikely]] {
+                return result;
+            }
+            if (!item.dirty()) {
+                return m_archive(bits::varint{item.bytes().size()},
+                                 bits::unsized(item.bytes()));
+            }
+            auto size_position = m_archive.position();
+            if (auto result = serialize_sized(item.get()); failure(result))
+                [[unlikely]] {
+                return result;
+            }
+            auto data = m_archive.data().data();
+            auto message_position = size_position;
+            while (std::uint8_t(data[message_position++]) & 0x80) {
+            }
+            item.store_bytes(data + message_position,
+                             m_archive.position() - message_position);
+            return {};
+        } else if constexpr (requires { type::serialize(*this, item); }) {
+            return type::serialize(*this, std::forward<decltype(item)>(item));
+        } else if constexpr (requires { serialize(*this, item); }) {
+            return serialize(*this, std::forward<decltype(item)>(item));
+        } else if constexpr (bits::concepts::optional<type>) {
+            if (item.has_value()) {
+                return serialize_field<FieldNum, TagType>(*item);
+            }
+            return {};
+        } else if constexpr (concepts::encodable_range<decltype(item)>) {
+            return serialize_range<FieldNum>(item);
+        } else if constexpr (!bits::concepts::container<type>) {
+            constexpr auto tag = make_tag<tag_type>(FieldNum);
+            if (auto result = m_archive(tag); failure(result)) [[unlikely]] {
+                return result;
+            }
+            return serialize_sized(std::forward<decltype(item)>(item));
+        } else if constexpr (bits::concepts::associative_container<type> &&
+                             requires { typename type::mapped_type; }) {
+            constexpr auto tag = make_tag<tag_type>(FieldNum);
+            for (auto &[key, value] : item) {
+                auto &&entry_key = map_entry_field(key);
+                auto &&entry_value = map_entry_field(value);
+                bits::errc error;
+                auto size = field_size<1>(entry_key, error) +
+                            field_size<2>(entry_value, error);
+                if (failure(error)) [[unlikely]] {
+                    return error;
+                }
+                if (auto result = m_archive(tag, bits::varint{size});
+                    failure(result)) [[unlikely]] {
+                    return result;
+                }
+                if (auto result = serialize_field<1>(entry_key);
+                    failure(result)) [[unlikely]] {
+                    return result;
+                }
+                if (auto result = serialize_field<2>(entry_value);
+                    failure(result)) [[unlikely]] {
+                    return result;
+                }
+            }
+            return {};
+        } else if constexpr (requires {
+                                 requires std::is_fundamental_v<
+                                     typename type::value_type> ||
+                                     std::same_as<typename type::value_type,
+                                                  std::byte>;
+                             }) {
+            constexpr auto tag = make_tag<tag_type>(FieldNum);
+            auto size = item.size();
+            if (!size) [[unlikely]] {
+                return {};
+            }
+            if (auto result = m_archive(
+                    tag, bits::varint{size * sizeof(typename type::value_type)},
+                    bits::unsized(std::forward<decltype(item)>(item)));
+                failure(result)) [[unlikely]] {
+                return result;
+            }
+            return {};
+        } else if constexpr (requires {
+                                 requires bits::concepts::varint<
+                                     typename type::value_type>;
+                             }) {
+            constexpr auto tag = make_tag<tag_type>(FieldNum);
+
+            std::size_t size = {};
+            for (auto &element : item) {
+                size += bits::varint_size<type::value_type::encoding>(element.value);
+            }
+            if (!size) [[unlikely]] {
+                return {};
+            }
+            if (auto result =
+                    m_archive(tag, bits::varint{size},
+                              bits::unsized(std::forward<decltype(item)>(item)));
+                failure(result)) [[unlikely]] {
+                return result;
+            }
+            return {};
+        } else if constexpr (requires {
+                                 requires std::is_enum_v<typename type::value_type>;
+                             }) {
+            constexpr auto tag = make_tag<tag_type>(FieldNum);
+
+            using type = typename type::value_type;
+            std::size_t size = {};
+            for (auto &element : item) {
+                size += bits::varint_size(std::underlying_type_t<type>(element));
+            }
+            if (!size) [[unlikely]] {
+                return {};
+            }
+            if (auto result = m_archive(tag, bits::varint{size}); failure(result))
+                [[unlikely]] {
+                return result;
+            }
+            for (auto &element : item) {
+                if (auto result =
+                        m_archive(bits::varint{std::underlying_type_t<type>(element)});
+                    failure(result)) [[unlikely]] {
+                    return result;
+                }
+            }
+            return {};
+        } else {
+            constexpr auto tag = make_tag<typename type::value_type>(FieldNum);
+            if constexpr (!std::is_void_v<parallel_type> &&
+                          requires { item.data(); }) {
+                if (!std::is_constant_evaluated()) {
+                    return serialize_parallel<tag>(item);
+                }
+            }
+            for (auto &element : item) {
+                if (auto result = m_archive(tag); failure(result)) [[unlikely]] {
+                    return result;
+                }
+                if (auto result = serialize_sized(element); failure(result)) [[unlikely]] {
+                    return result;
+                }
+            }
+            return {};
+        }
+    }
+
+    // Encodes a range that is not a container as a repeated field, scalars
+    // are packed with the length computed up front for multipass ranges and
+    // back-filled for single pass ones.
+    template <auto FieldNum>
+    constexpr bits::errc serialize_range(auto &&range)
+    {
+        using element_type =
+            std::remove_cvref_t<std::ranges::range_reference_t<decltype(range)>>;
+
+        if constexpr (!concepts::is_length_delimited<element_type> ||
+                      std::is_enum_v<element_type>) {
+            constexpr auto tag =
+                make_tag_explicit(wire_type::length_delimited, FieldNum);
+            auto encode = [](const element_type &element) {
+                if constexpr (std::is_enum_v<element_type>) {
+                    return bits::varint{
+                        std::underlying_type_t<element_type>(element)};
+                } else {
+                    return element;
+                }
+            };
+
+            if constexpr (std::ranges::forward_range<decltype(range)>) {
+                std::size_t size = {};
+                for (auto &&element : range) {
+                    if constexpr (std::is_enum_v<element_type>) {
+                        size += bits::varint_size(
+                            std::underlying_type_t<element_type>(element));
+                    } else if constexpr (bits::concepts::varint<element_type>) {
+                        size += bits::varint_size<element_type::encoding>(
+                            element_type(element).value);
+                    } else {
+                        size += sizeof(element_type);
+                    }
+                }
+                if (!size) {
+                    return {};
+                }
+                if (auto result = m_archive(tag, bits::varint{size});
+                    failure(result)) [[unlikely]] {
+                    return result;
+                }
+                for (auto &&element : range) {
+                    if (auto result = m_archive(encode(element));
+                        failure(result)) [[unlikely]] {
+                        return result;
+                    }
+                }
+                return {};
+            } else {
+                auto it = std::ranges::begin(range);
+                auto end = std::ranges::end(range);
+                if (it == end) {
+                    return {};
+                }
+                if (auto result = m_archive(tag); failure(result)) [[unlikely]] {
+                    return result;
+                }
+                auto size_position = m_archive.position();
+                if (auto result = m_archive(bits::vsize_t{}); failure(result))
+                    [[unlikely]] {
+                    return result;
+                }
+                for (; it != end; ++it) {
+                    if (auto result = m_archive(encode(*it)); failure(result))
+                        [[unlikely]] {
+                        return result;
+                    }
+                }
+                return write_length(size_position);
+            }
+        } else if constexpr (concepts::bytes_field<element_type>) {
+            constexpr auto tag =
+                make_tag_explicit(wire_type::length_delimited, FieldNum);
+            for (auto &&element : range) {
+                if (auto result = m_archive(tag,
+                                            bits::varint{element.size()},
+                                            bits::unsized(element));
+                    failure(result)) [[unlikely]] {
+                    return result;
+                }
+            }
+            return {};
+        } else {
+            constexpr auto tag = make_tag<element_type>(FieldNum);
+            for (auto &&element : range) {
+                if (auto result = m_archive(tag); failure(result)) [[unlikely]] {
+                    return result;
+                }
+                if (auto result = serialize_sized(element); failure(result))
+                    [[unlikely]] {
+                    return result;
+                }
+            }
+            return {};
+        }
+    }
+
+    // Encodes the elements in order until the field reaches the parallel
+    // threshold. The remaining elements are then sized across threads, the
+    // field is reserved once, and every element is encoded across threads
+    // at its precomputed offset. Elements are encoded without the parallel
+    // option, so nested repeated fields are never split again.
+    template <auto Tag>
+    bits::errc serialize_parallel(auto &&item)
+    {
+        auto start = m_archive.position();
+        std::size_t first = 0;
+        for (; first < item.size(); ++first) {
+            if (m_archive.position() - start >=
+                parallel_type::parallel_threshold) {
+                break;
+            }
+            if (auto result = m_archive(Tag); failure(result)) [[unlikely]] {
+                return result;
+            }
+            if (auto result = serialize_sized(item[first]); failure(result))
+                [[unlikely]] {
+                return result;
+            }
+        }
+        if (first == item.size()) {
+            return {};
+        }
+
+        auto count = item.size() - first;
+        std::vector<std::size_t> sizes(count);
+        if (auto result = parallel_type::run(
+                count,
+                [&](std::size_t begin, std::size_t end) {
+                    bits::errc error;
+                    for (auto i = begin; i < end && success(error); ++i) {
+                        sizes[i] = message_size(item[first + i], error);
+                    }
+                    return error;
+                });
+            failure(result)) [[unlikely]] {
+            return result;
+        }
+
+        constexpr auto tag_size = bits::varint_size(Tag.value);
+        std::vector<std::size_t> offsets(count + 1);
+        for (std::size_t i = 0; i < count; ++i) {
+            offsets[i + 1] =
+                offsets[i] + tag_size + length_delimited_size(sizes[i]);
+        }
+
+        auto total = offsets.back();
+        if constexpr (archive_type::resizable) {
+            if (auto result = m_archive.enlarge_for(total); failure(result))
+                [[unlikely]] {
+                return result;
+            }
+        } else if (total > m_archive.data().size() - m_archive.position())
+            [[unlikely]] {
+            return std::errc::result_out_of_range;
+        }
+
+        auto data = m_archive.data().data() + m_archive.position();
+        auto encode = [&](std::size_t begin, std::size_t end) {
+            for (auto i = begin; i < end; ++i) {
+                std::span slice{data + offsets[i], data + offsets[i + 1]};
+                out<decltype(slice)> element_out{slice};
+                if (auto result =
+                        element_out.m_archive(Tag, bits::varint{sizes[i]});
+                    failure(result)) [[unlikely]] {
+                    return result;
+                }
+                if (auto result = element_out.serialize_unsized(item[first + i]);
+                    failure(result)) [[unlikely]] {
+                    return result;
+                }
+                if (element_out.position() != slice.size()) [[unlikely]] {
+                    return bits::errc{std::errc::invalid_argument};
+                }
+            }
+            return bits::errc{};
+        };
+        if (auto result = parallel_type::run(count, encode); failure(result))
+            [[unlikely]] {
+            return result;
+        }
+        m_archive.position() += total;
+        return {};
+    }
+
+    template <typename SizeType = bits::vsize_t>
+    constexpr bits::errc ZPP_BITS_INLINE serialize_sized(auto &&item)
+    {
+        using type = std::remove_cvref_t<decltype(item)>;
+
+        if constexpr (concepts::interned_field<type>) {
+            return m_archive(bits::varint{item.size()},
+                             bits::unsized(item.view()));
+        } else {
+            auto size_position = m_archive.position();
+            if (auto result = m_archive(SizeType{}); failure(result))
+                [[unlikely]] {
+                return result;
+            }
+
+            if (auto result =
+                    serialize_unsized(std::forward<decltype(item)>(item));
+                failure(result)) [[unlikely]] {
+                return result;
+            }
+
+            return write_length<SizeType>(size_position);
+        }
+    }
+
+    // Back-fills the SizeType placeholder written at size_position with the
+    // size of what was written after it, a varint longer than the single
+    // byte placeholder moves the data ahead.
+    template <typename SizeType = bits::vsize_t>
+    constexpr bits::errc ZPP_BITS_INLINE write_length(std::size_t size_position)
+    {
+        auto current_position = m_archive.position();
+        std::size_t message_size =
+            current_position - size_position - sizeof(SizeType);
+
+        if constexpr (bits::concepts::varint<SizeType>) {
+            constexpr auto preserialized_varint_size = 1;
+            message_size =
+                current_position - size_position - preserialized_varint_size;
+            auto move_ahead_count =
+                bits::varint_size(message_size) - preserialized_varint_size;
+            if (move_ahead_count) {
+                if constexpr (archive_type::resizable) {
+                    if (auto result = m_archive.enlarge_for(move_ahead_count);
+                        failure(result)) [[unlikely]] {
+                        return result;
+                    }
+                } else if (move_ahead_count >
+                           m_archive.data().size() - current_position) [[unlikely]] {
+                    return std::errc::result_out_of_range;
+                }
+                auto data = m_archive.data().data();
+                auto message_start = data + size_position + preserialized_varint_size;
+                auto message_end = data + current_position;
+                if (std::is_constant_evaluated()) {
+                    for (auto p = message_end - 1; p >= message_start; --p) {
+                        *(p + move_ahead_count) = *p;
+                    }
+                } else {
+                    std::memmove(message_start + move_ahead_count, message_start,
+                                 message_size);
+                }
+                m_archive.position() += move_ahead_count;
+            }
+        }
+
+        auto message_length_span =
+            std::span<typename archive_type::byte_type, sizeof(SizeType)>{
+                m_archive.data().data() + size_position, sizeof(SizeType)};
+        auto message_length_out = bits::out<
+            std::span<typename archive_type::byte_type, sizeof(SizeType)>>{
+            message_length_span};
+        return message_length_out(SizeType(message_size));
+    }
+
+    template <typename SizeType = default_size_type>
+    constexpr bits::errc ZPP_BITS_INLINE serialize_one(auto &&item)
+    {
+        if constexpr (!std::is_void_v<SizeType>) {
+            return serialize_sized<SizeType>(std::forward<decltype(item)>(item));
+        } else {
+            return serialize_unsized(std::forward<decltype(item)>(item));
+        }
+    }
+};
+
+// An immutable sub-message member that is encoded once on construction,
+// out writes it with its precomputed tag and a single copy of the length
+// prefixed bytes. Decoding replaces the value and leaves the encoding to
+// the next serialize. Encoding a const pre_encoded after a decode stores
+// the bytes through the mutable members, so it must not be encoded from
+// several threads at once until it has been encoded once.
+template <typename Type>
+class pre_encoded
+{
+public:
+    using value_type = Type;
+    using pre_encoded_type = Type;
+
+    pre_encoded() = default;
+
+    explicit pre_encoded(Type value) : m_value(std::move(value))
+    {
+        encode();
+    }
+
+    const Type &get() const
+    {
+        return m_value;
+    }
+
+    // Replaces the value, the encoding is redone on the next use.
+    void reset(Type value)
+    {
+        m_value = std::move(value);
+        m_stale = true;
+    }
+
+    // The encoded bytes of the value, including the length prefix.
+    std::span<const std::byte> encoded() const
+    {
+        if (m_stale) {
+            encode();
+        }
+        return m_encoded;
+    }
+
+private:
+    void encode() const
+    {
+        m_encoded.clear();
+        out output{m_encoded};
+        output.serialize_sized(m_value).or_throw();
+        m_encoded.resize(output.position());
+        m_stale = false;
+    }
+
+    Type m_value{};
+    mutable std::vector<std::byte> m_encoded;
+    mutable bool m_stale = true;
+};
+
+// The exact number of bytes out::serialize_field<FieldNum, TagType>()
+// writes for item, a failing custom serialize() is reported in error.
+template <auto FieldNum, typename TagType>
+constexpr std::size_t field_size(const auto &item, bits::errc &error)
+{
+    using type = std::remove_cvref_t<decltype(item)>;
+    using tag_type = std::conditional_t<std::is_void_v<TagType>, type, TagType>;
+
+    if constexpr (bits::concepts::empty<type>) {
+        return 0;
+    } else if constexpr (std::is_enum_v<type> &&
+                         !std::same_as<type, std::byte>) {
+        constexpr auto tag = make_tag<tag_type>(FieldNum);
+        return bits::varint_size(tag.value) +
+               bits::varint_size(std::underlying_type_t<type>(item));
+    } else if constexpr (!concepts::is_length_delimited<type>) {
+        constexpr auto tag = make_tag<tag_type>(FieldNum);
+        if (item == 0) {
+            return 0;
+        }
+        if constexpr (bits::concepts::varint<type>) {
+            return bits::varint_size(tag.value) +
+                   bits::varint_size<type::encoding>(item.value);
+        } else {
+            return bits::varint_size(tag.value) + sizeof(type);
+        }
+    } else if constexpr (requires(out<> &archive) {
+                             type::serialize(archive, item);
+                         } ||
+                         requires(out<> &archive) { serialize(archive, item); }) {
+        std::vector<std::byte> data;
+        out archive{data};
+        if (auto result =
+                archive.template serialize_field<FieldNum, TagType>(item);
+            failure(result)) [[unlikely]] {
+            error = result;
+            return 0;
+        }
+        return archive.position();
+    } else if constexpr (concepts::pre_encoded_message<type>) {
+        constexpr auto tag = make_tag<tag_type>(FieldNum);
+        return bits::varint_size(tag.value) + item.encoded().size();
+    } else if constexpr (concepts::interned_field<type>) {
+        constexpr auto tag = make_tag<tag_type>(FieldNum);
+        return item.empty() ? 0
+                            : bits::varint_size(tag.value) +
+                                  length_delimited_size(item.size());
+    } else if constexpr (concepts::cached_message<type>) {
+        constexpr auto tag = make_tag<tag_type>(FieldNum);
+        return bits::varint_size(tag.value) +
+               length_delimited_size(item.dirty()
+                                         ? message_size(item.get(), error)
+                                         : item.bytes().size());
+    } else if constexpr (bits::concepts::optional<type>) {
+        if (item.has_value()) {
+            return field_size<FieldNum, TagType>(*item, error);
+        }
+        return 0;
+    } else if constexpr (concepts::encodable_range<type>) {
+        static_assert(std::ranges::forward_range<const type>,
+                      "only multipass ranges iterable as const can be sized");
+        using element_type =
+            std::remove_cvref_t<std::ranges::range_reference_t<const type>>;
+
+        if constexpr (!concepts::is_length_delimited<element_type> ||
+                      std::is_enum_v<element_type>) {
+            constexpr auto tag =
+                make_tag_explicit(wire_type::length_delimited, FieldNum);
+            std::size_t size = {};
+            for (auto &&element : item) {
+                if constexpr (std::is_enum_v<element_type>) {
+                    size += bits::varint_size(
+                        std::underlying_type_t<element_type>(element));
+                } else if constexpr (bits::concepts::varint<element_type>) {
+                    size += bits::varint_size<element_type::encoding>(
+                        element_type(element).value);
+                } else {
+                    size += sizeof(element_type);
+                }
+            }
+            if (!size) {
+                return 0;
+            }
+            return bits::varint_size(tag.value) + length_delimited_size(size);
+        } else if constexpr (concepts::bytes_field<element_type>) {
+            constexpr auto tag =
+                make_tag_explicit(wire_type::length_delimited, FieldNum);
+            std::size_t size = {};
+            for (auto &&element : item) {
+                size += bits::varint_size(tag.value) +
+                        length_delimited_size(element.size());
+            }
+            return size;
+        } else {
+            constexpr auto tag = make_tag<element_type>(FieldNum);
+            std::size_t size = {};
+            for (auto &&element : item) {
+                size += bits::varint_size(tag.value) +
+                        length_delimited_size(message_size(element, error));
+            }
+            return size;
+        }
+    } else if constexpr (!bits::concepts::container<type>) {
+        constexpr auto tag = make_tag<tag_type>(FieldNum);
+        return bits::varint_size(tag.value) +
+               length_delimited_size(message_size(item, error));
+    } else if constexpr (bits::concepts::associative_container<type> &&
+                         requires { typename type::mapped_type; }) {
+        constexpr auto tag = make_tag<tag_type>(FieldNum);
+        std::size_t size = {};
+        for (auto &[key, value] : item) {
+            size += bits::varint_size(tag.value) +
+                    length_delimited_size(
+                        field_size<1>(map_entry_field(key), error) +
+                        field_size<2>(map_entry_field(value), error));
+        }
+        return size;
+    } else if constexpr (requires {
+                             requires std::is_fundamental_v<
+                                 typename type::value_type> ||
+                                 std::same_as<typename type::value_type,
+                                              std::byte>;
+                         }) {
+        constexpr auto tag = make_tag<tag_type>(FieldNum);
+        if (item.empty()) {
+            return 0;
+        }
+        return bits::varint_size(tag.value) +
+               length_delimited_size(item.size() *
+                                     sizeof(typename type::value_type));
+    } else if constexpr (requires {
+                             requires bits::concepts::varint<
+                                 typename type::value_type> ||
+                                 std::is_enum_v<typename type::value_type>;
+                         }) {
+        constexpr auto tag = make_tag<tag_type>(FieldNum);
+        std::size_t size = {};
+        for (auto &element : item) {
+            if constexpr (std::is_enum_v<typename type::value_type>) {
+                size += bits::varint_size(
+                    std::underlying_type_t<typename type::value_type>(element));
+            } else {
+                size += bits::varint_size<type::value_type::encoding>(
+                    element.value);
+            }
+        }
+        if (!size) {
+            return 0;
+        }
+        return bits::varint_size(tag.value) + length_delimited_size(size);
+    } else {
+        constexpr auto tag = make_tag<typename type::value_type>(FieldNum);
+        std::size_t size = {};
+        for (auto &element : item) {
+            if constexpr (concepts::interned_field<typename type::value_type>) {
+                size += bits::varint_size(tag.value) +
+                        length_delimited_size(element.size());
+            } else {
+                size += bits::varint_size(tag.value) +
+                        length_delimited_size(message_size(element, error));
+            }
+        }
+        return size;
+    }
+}
+
+// The exact number of bytes of the fields of item, without a length
+// prefix, a failing custom serialize() is reported in error.
+template <typename Type>
+constexpr std::size_t message_size(const Type &item, bits::errc &error)
+{
+    return bits::visit_members(item, [&](auto &...members) constexpr {
+        return [&]<std::size_t... Indices>(std::index_sequence<Indices...>) {
+            return (std::size_t{} + ... +
+                    field_size<field_num<Type, Indices>()>(members, error));
+        }(std::make_index_sequence<sizeof...(members)>{});
+    });
+}
+
+// As above, throws when a custom serialize() fails.
+template <auto FieldNum, typename TagType>
+constexpr std::size_t field_size(const auto &item)
+{
+    bits::errc error;
+    auto size = field_size<FieldNum, TagType>(item, error);
+    error.or_throw();
+    return size;
+}
+
+template <typename Type>
+constexpr std::size_t message_size(const Type &item)
+{
+    bits::errc error;
+    auto size = message_size(item, error);
+    error.or_throw();
+    return size;
+}
+
+template <bits::concepts::byte_view ByteView, typename... Options>
+constexpr auto make_in_archive(ByteView &&view, Options &&...options)
+{
+    return bits::in{std::forward<ByteView>(view), bits::size_varint{},
+                    bits::endian::little{},
+                    bits::alloc_limit<bits::traits::alloc_limit<Options...>()>{}};
+}
+
+template <bits::concepts::byte_view ByteView = std::vector<std::byte>,
+          typename... Options>
+class in {
+    using archive_type = decltype(make_in_archive(std::declval<ByteView &>(),
+                                                  std::declval<Options &&>()...));
+
+    // The pool of the intern option, nothing without it.
+    using pool_type =
+        std::conditional_t<traits::has_option<intern, Options...>(),
+                           string_pool *, std::monostate>;
+
+    archive_type m_archive;
+    [[no_unique_address]] pool_type m_pool{};
+
+    constexpr static pool_type interning_pool(const auto &...options)
+    {
+        pool_type pool{};
+        (
+            [&] {
+                if constexpr (std::same_as<
+                                  std::remove_cvref_t<decltype(options)>,
+                                  intern>) {
+                    pool = options.pool;
+                }
+            }(),
+            ...);
+        return pool;
+    }
+
+public:
+    // using byte_type = std::add_const_t<typename ByteView::value_type>;
+
+    using default_size_type = traits::default_size_type_t<Options...>;
+
+    constexpr static bool is_trusted = traits::has_option<trusted, Options...>();
+
+    constexpr static bool is_padded =
+        !is_trusted && traits::padding<Options...>() != 0;
+
+    using field_mask_type = traits::field_mask_t<Options...>;
+
+    constexpr explicit in(ByteView &&view, Options &&...options) :
+        m_archive(make_in_archive(std::move(view),
+                                  std::forward<Options>(options)...)),
+        m_pool(interning_pool(options...))
+    {}
+
+    constexpr explicit in(ByteView &view, Options &&...options) :
+        m_archive(make_in_archive(view, std::forward<Options>(options)...)),
+        m_pool(interning_pool(options...))
+    {}
+
+    ZPP_BITS_INLINE constexpr bits::errc
+    operator()(auto &item)
+    {
+        return serialize_one<default_size_type, field_mask_type>(item);
+    }
+
+    constexpr std::size_t position() const
+    {
+        return m_archive.position();
+    }
+
+
+    constexpr std::size_t &position()
+    {
+        return m_archive.position();
+    }
+
+    constexpr auto remaining_data()
+    {
+        return m_archive.remaining_data();
+    }
+
+    constexpr static auto kind()
+    {
+        return bits::kind::in;
+    }
+
+    template <typename Mask = void>
+    ZPP_BITS_INLINE constexpr bits::errc deserialize_fields(auto &item, std::size_t end_position)
+    {
+        using type = std::remove_cvref_t<decltype(item)>;
+        static_assert(check_type<type>());
+
+        bits::visit_members(item, [](auto &...members) ZPP_BITS_CONSTEXPR_INLINE_LAMBDA {
+            [&]<std::size_t... Indices>(std::index_sequence<Indices...>)
+                ZPP_BITS_CONSTEXPR_INLINE_LAMBDA {
+                    ((mask_selects<Mask, type, Indices>() ? reset_member(members)
+                                                          : void()),
+                     ...);
+                }(std::make_index_sequence<sizeof...(members)>{});
+        });
+
+        while (m_archive.position() < end_position) {
+            std::uint32_t number;
+            wire_type type;
+            if (auto result = read_tag(number, type); failure(result))
+                [[unlikely]] {
+                return result;
+            }
+
+            if (auto result = deserialize_field<Mask>(item, number, type,
+                                                      end_position);
+                failure(result)) [[unlikely]] {
+                return result;
+            }
+
+            if constexpr (is_padded) {
+                if (m_archive.position() > m_archive.data().size()) [[unlikely]] {
+                    return std::errc::result_out_of_range;
+                }
+            }
+        }
+
+        return {};
+    }
+
+    ZPP_BITS_INLINE constexpr bits::errc read_tag(std::uint32_t &field_number,
+                                                  wire_type &field_type)
+    {
+        bits::vuint32_t tag;
+        if (auto result = read_scalar(tag); failure(result)) [[unlikely]] {
+            return result;
+        }
+        if constexpr (is_padded) {
+            if (m_archive.position() > m_archive.data().size()) [[unlikely]] {
+                return std::errc::result_out_of_range;
+            }
+        }
+        field_number = tag_number(tag);
+        field_type = proto::tag_type(tag);
+        return {};
+    }
+
+    // Reads a length prefix, with padded input this is where a position that
+    // went past the end is caught, before the length is compared against the
+    // remaining data.
+    template <typename Type>
+    ZPP_BITS_INLINE constexpr bits::errc read_length(Type &length)
+    {
+        if (auto result = read_scalar(length); failure(result)) [[unlikely]] {
+            return result;
+        }
+        if constexpr (is_padded) {
+            if (m_archive.position() > m_archive.data().size()) [[unlikely]] {
+                return std::errc::result_out_of_range;
+            }
+        }
+        return {};
+    }
+
+    ZPP_BITS_INLINE constexpr bits::errc skip_field(wire_type field_type)
+    {
+        std::size_t size = 0;
+        switch (field_type) {
+        case wire_type::varint:
+            return skip_varint();
+        case wire_type::fixed_64:
+            size = sizeof(std::uint64_t);
+            break;
+        case wire_type::fixed_32:
+            size = sizeof(std::uint32_t);
+            break;
+        case wire_type::length_delimited: {
+            bits::vsize_t length;
+            if (auto result = read_length(length); failure(result)) [[unlikely]] {
+                return result;
+            }
+            size = length;
+            break;
+        }
+        default:
+            return std::errc::protocol_error;
+        }
+
+        if constexpr (!is_trusted) {
+            if (size > m_archive.remaining_data().size()) [[unlikely]] {
+                return std::errc::result_out_of_range;
+            }
+        }
+        m_archive.position() += size;
+        return {};
+    }
+
+    template <typename Type>
+    constexpr bits::errc validate()
+    {
+        if constexpr (!std::is_void_v<default_size_type>) {
+            default_size_type size{};
+            if (auto result = m_archive(size); failure(result)) [[unlikely]] {
+                return result;
+            }
+            if (size > m_archive.remaining_data().size()) [[unlikely]]
+                return bits::errc{std::errc::message_size};
+
+            return validate_fields<Type>(m_archive.position() + size);
+        } else {
+            return validate_fields<Type>(m_archive.data().size());
+        }
+    }
+
+    template <typename Mask = void, std::size_t Index = 0>
+    ZPP_BITS_INLINE constexpr auto
+    deserialize_field(auto &&item, auto field_num,
+                      wire_type field_type, std::size_t end_position)
+    {
+        using type = std::remove_reference_t<decltype(item)>;
+        if constexpr (Index >= bits::number_of_members<type>()) {
+            // unknown field, we should skip it
+            if (!field_num) [[unlikely]] {
+                return bits::errc{std::errc::protocol_error};
+            }
+            return skip_field(field_type);
+        } else if (proto::field_num<type, Index>() != field_num) {
+            return deserialize_field<Mask, Index + 1>(item, field_num, field_type,
+                                                      end_position);
+        } else if constexpr (!mask_selects<Mask, type, Index>()) {
+            return skip_field(field_type);
+        } else if constexpr (bits::concepts::self_referencing<type>) {
+            return bits::visit_members(
+                item, [&](auto &&...items) constexpr {
+                    std::tuple<decltype(items) &...> refs = {items...};
+                    return deserialize_member<sub_mask_t<Mask, type, Index>>(
+                        std::get<Index>(refs), field_num, field_type,
+                        end_position);
+                });
+        } else {
+            return bits::visit_members(
+                item, [&](auto &&...items) ZPP_BITS_CONSTEXPR_INLINE_LAMBDA {
+                    std::tuple<decltype(items) &...> refs = {items...};
+                    return deserialize_member<sub_mask_t<Mask, type, Index>>(
+                        std::get<Index>(refs), field_num, field_type,
+                        end_position);
+                });
+        }
+    }
+
+    // Decodes a member of a message, a map member decodes the whole run of
+    // its consecutive entries.
+    template <typename Mask>
+    ZPP_BITS_INLINE constexpr bits::errc
+    deserialize_member(auto &item, std::uint32_t field_num,
+                       wire_type field_type, std::size_t end_position)
+    {
+        using member_type = std::remove_reference_t<decltype(item)>;
+        static_assert(check_type<member_type>());
+
+        if constexpr (bits::concepts::associative_container<member_type> &&
+                      requires { typename member_type::mapped_type; }) {
+            if (field_type == wire_type::length_delimited) {
+                return deserialize_map(item, field_num, end_position);
+            }
+        }
+        return deserialize_field<Mask>(field_type, item);
+    }
+
+    // Decodes a field of an element of columns into the back of the column
+    // of its member.
+    template <typename Mask = void, std::size_t Index = 0>
+    constexpr bits::errc deserialize_column(auto &item, std::uint32_t field_num,
+                                            wire_type field_type)
+    {
+        using type = typename std::remove_cvref_t<decltype(item)>::value_type;
+        if constexpr (Index >= bits::number_of_members<type>()) {
+            if (!field_num) [[unlikely]] {
+                return std::errc::protocol_error;
+            }
+            return skip_field(field_type);
+        } else if (std::uint32_t(proto::field_num<type, Index>()) != field_num) {
+            return deserialize_column<Mask, Index + 1>(item, field_num,
+                                                       field_type);
+        } else if constexpr (!mask_selects<Mask, type, Index>()) {
+            return skip_field(field_type);
+        } else if constexpr (std::same_as<member_type_t<type, Index>, bool>) {
+            bool value{};
+            if (auto result = read_scalar(value); failure(result)) [[unlikely]] {
+                return result;
+            }
+            item.template column<Index>().back() = value;
+            return {};
+        } else {
+            return deserialize_field<sub_mask_t<Mask, type, Index>>(
+                field_type, item.template column<Index>().back());
+        }
+    }
+
+    // Decodes the run of consecutive entries of a map field, up to
+    // end_position, see decode_map_entries().
+    template <typename Type>
+    constexpr bits::errc deserialize_map(Type &item, std::uint32_t number,
+                                         std::size_t end_position)
+    {
+        return decode_map_entries(item, [&] {
+            auto position = m_archive.position();
+            if (position >= end_position) {
+                return false;
+            }
+            std::uint32_t next_number;
+            wire_type next_type;
+            if (failure(read_tag(next_number, next_type)) ||
+                next_number != number ||
+                next_type != wire_type::length_delimited) {
+                m_archive.position() = position;
+                return false;
+            }
+            return true;
+        });
+    }
+
+    // Decodes a single map entry that is not read from a map member, such
+    // as the entry of an optional map.
+    template <typename Type>
+    constexpr bits::errc deserialize_map_entry(Type &item)
+    {
+        return decode_map_entries(item, [] { return false; });
+    }
+
+    // Decodes the entry at the current position and the ones after it for
+    // as long as next_entry() reads the tag of another one. Maps with
+    // reserve() reserve for the whole run, flat maps (extract() and
+    // replace()) append and sort once, other maps insert with an end hint
+    // which is constant time when keys arrive sorted. Later entries replace
+    // earlier ones with the same key.
+    template <typename Type>
+    constexpr bits::errc decode_map_entries(Type &item, auto &&next_entry)
+    {
+        using value_type = map_entry<Type>;
+
+        auto decode_run = [&](auto &&insert) {
+            do {
+                std::aligned_storage_t<sizeof(value_type), alignof(value_type)> storage;
+                auto object = bits::access::placement_new<value_type>(
+                    std::addressof(storage));
+                bits::destructor_guard guard{*object};
+                if (auto result = serialize_one<bits::varint<uint32_t>>(*object);
+                    failure(result)) [[unlikely]] {
+                    return result;
+                }
+                insert(std::move(object->key), std::move(object->value));
+            } while (next_entry());
+            return bits::errc{};
+        };
+
+        if constexpr (requires { item.reserve(1); }) {
+            auto position = m_archive.position();
+            std::size_t count = 1;
+            if (success(skip_field(wire_type::length_delimited))) {
+                while (next_entry()) {
+                    ++count;
+                    if (failure(skip_field(wire_type::length_delimited))) {
+                        break;
+                    }
+                }
+            }
+            m_archive.position() = position;
+            item.reserve(item.size() + count);
+        }
+
+        if constexpr (requires {
+                          std::move(item).extract().keys;
+                          std::move(item).extract().values;
+                      }) {
+            auto containers = std::move(item).extract();
+            auto result = decode_run([&](auto &&key, auto &&value) {
+                containers.keys.push_back(std::move(key));
+                containers.values.push_back(std::move(value));
+            });
+
+            auto &keys = containers.keys;
+            auto &values = containers.values;
+            typename Type::key_compare compare{};
+            std::vector<std::size_t> order(keys.size());
+            std::iota(order.begin(), order.end(), std::size_t{});
+            std::stable_sort(order.begin(), order.end(), [&](auto a, auto b) {
+                return compare(keys[a], keys[b]);
+            });
+
+            std::remove_cvref_t<decltype(keys)> sorted_keys;
+            std::remove_cvref_t<decltype(values)> sorted_values;
+            sorted_keys.reserve(order.size());
+            sorted_values.reserve(order.size());
+            for (std::size_t i = 0; i < order.size(); ++i) {
+                if (i + 1 < order.size() &&
+                    !compare(keys[order[i]], keys[order[i + 1]])) {
+                    continue;
+                }
+                sorted_keys.push_back(std::move(keys[order[i]]));
+                sorted_values.push_back(std::move(values[order[i]]));
+            }
+            item.replace(std::move(sorted_keys), std::move(sorted_values));
+            return result;
+        } else if constexpr (requires(typename Type::key_type key,
+                                      typename Type::mapped_type value) {
+                                 item.insert_or_assign(item.end(),
+                                                       std::move(key),
+                                                       std::move(value));
+                             }) {
+            return decode_run([&](auto &&key, auto &&value) {
+                item.insert_or_assign(item.end(), std::move(key),
+                                      std::move(value));
+            });
+        } else {
+            return decode_run([&](auto &&key, auto &&value) {
+                item.emplace(std::move(key), std::move(value));
+            });
+        }
+    }
+
+    template <typename Mask = void>
+    ZPP_BITS_INLINE constexpr auto
+    deserialize_field(wire_type field_type, auto &item)
+    {
+        using type = std::remove_reference_t<decltype(item)>;
+        static_assert(check_type<type>());
+
+        if constexpr (std::is_enum_v<type>) {
+            bits::varint<type> value;
+            if (auto result = read_scalar(value); failure(result)) [[unlikely]] {
+                return result;
+            }
+            item = value;
+            return bits::errc{};
+        } else if constexpr (!concepts::is_length_delimited<type>) {
+            return read_scalar(item);
+        } else if constexpr (concepts::sink_field<type>) {
+            if (auto result =
+                    deserialize_field<Mask>(field_type, item.scratch());
+                failure(result)) [[unlikely]] {
+                return result;
+            }
+            return item.consume();
+        } else if constexpr (concepts::columns_field<type>) {
+            bits::vsize_t length;
+            if (auto result = read_length(length); failure(result)) [[unlikely]] {
+                return result;
+            }
+            if constexpr (!is_trusted) {
+                if (length > m_archive.remaining_data().size()) [[unlikely]] {
+                    return bits::errc{std::errc::message_size};
+                }
+            }
+            auto end_position = m_archive.position() + length;
+            item.push_back();
+            while (m_archive.position() < end_position) {
+                std::uint32_t number;
+                wire_type element_type;
+                if (auto result = read_tag(number, element_type);
+                    failure(result)) [[unlikely]] {
+                    return result;
+                }
+                if (auto result = deserialize_column<Mask>(item, number,
+                                                           element_type);
+                    failure(result)) [[unlikely]] {
+                    return result;
+                }
+            }
+            return bits::errc{};
+        } else if constexpr (concepts::interned_field<type>) {
+            static_assert(!std::same_as<pool_type, std::monostate>,
+                          "interned_string members need the intern option");
+            bits::vsize_t length;
+            if (auto result = read_length(length); failure(result)) [[unlikely]] {
+                return result;
+            }
+            if constexpr (!is_trusted) {
+                if (length > m_archive.remaining_data().size()) [[unlikely]] {
+                    return bits::errc{std::errc::result_out_of_range};
+                }
+            }
+            item = m_pool->intern(
+                {reinterpret_cast<const char *>(m_archive.remaining_data().data()),
+                 length});
+            m_archive.position() += length;
+            return bits::errc{};
+        } else if constexpr (concepts::pre_encoded_message<type>) {
+            bits::vsize_t length;
+            if (auto result = read_length(length); failure(result)) [[unlikely]] {
+                return result;
+            }
+            if constexpr (!is_trusted) {
+                if (length > m_archive.remaining_data().size()) [[unlikely]] {
+                    return bits::errc{std::errc::message_size};
+                }
+            }
+            auto end = m_archive.position() + length;
+            typename type::value_type value;
+            if (auto result = deserialize_fields<Mask>(value, end);
+                failure(result)) [[unlikely]] {
+                return result;
+            }
+            item.reset(std::move(value));
+            return bits::errc{};
+        } else if constexpr (concepts::cached_message<type>) {
+            bits::vsize_t length;
+            if (auto result = read_length(length); failure(result)) [[unlikely]] {
+                return result;
+            }
+            if constexpr (!is_trusted) {
+                if (length > m_archive.remaining_data().size()) [[unlikely]] {
+                    return bits::errc{std::errc::message_size};
+                }
+            }
+            auto message_position = m_archive.position();
+            if (auto result = item.modify([&](auto &value) {
+                    return deserialize_fields<Mask>(value,
+                                                    message_position + length);
+                });
+                failure(result)) [[unlikely]] {
+                return result;
+            }
+            if constexpr (std::is_void_v<Mask>) {
+                item.store_bytes(m_archive.data().data() + message_position,
+                                 length);
+            }
+            return bits::errc{};
+        } else if constexpr (requires { type::serialize(*this, item); }) {
+            return type::serialize(*this, item);
+        } else if constexpr (requires { serialize(*this, item); }) {
+            return serialize(*this, item);
+        } else if constexpr (bits::concepts::optional<type>) {
+            return deserialize_field<Mask>(field_type, item.emplace());
+        } else if constexpr (!bits::concepts::container<type>) {
+            return serialize_one<bits::varint<uint32_t>, Mask>(item);
+        } else if constexpr (bits::concepts::associative_container<type> &&
+                             requires { typename type::mapped_type; }) {
+            return deserialize_map_entry(item);
+        } else {
+            using orig_value_type = typename type::value_type;
+            using value_type =
+                std::conditional_t<std::is_enum_v<orig_value_type> &&
+                                       !std::same_as<orig_value_type, std::byte>,
+                                   bits::varint<orig_value_type>, orig_value_type>;
+
+            if constexpr (!concepts::is_length_delimited<value_type>) {
+                auto fetch = [&]() ZPP_BITS_CONSTEXPR_INLINE_LAMBDA {
+                    value_type value;
+                    if (auto result = read_scalar(value); failure(result)) [[unlikely]] {
+                        return result;
+                    }
+
+                    if constexpr (requires { item.push_back(orig_value_type(value)); }) {
+                        item.push_back(orig_value_type(value));
+                    } else {
+                        item.insert(orig_value_type(value));
+                    }
+
+                    return bits::errc{};
+                };
+                if (field_type != wire_type::length_delimited) [[unlikely]] {
+                    return fetch();
+                }
+                bits::vsize_t length;
+                if (auto result = read_length(length); failure(result)) [[unlikely]] {
+                    return result;
+                }
+
+                if constexpr (requires { item.resize(1); } &&
+                              ( std::is_fundamental_v<value_type> ||
+                                std::same_as<value_type, std::byte> ) ) {
+                    if constexpr (archive_type::allocation_limit !=
+                                  std::numeric_limits<std::size_t>::max()) {
+                        if (length > archive_type::allocation_limit) [[unlikely]] {
+                            return bits::errc{std::errc::message_size};
+                        }
+                    }
+                    item.resize(length / sizeof(value_type));
+                    if constexpr (is_trusted &&
+                                  std::endian::native == std::endian::little &&
+                                  requires { item.data(); }) {
+                        if (!std::is_constant_evaluated()) {
+                            auto size = item.size() * sizeof(value_type);
+                            std::memcpy(item.data(),
+                                        m_archive.remaining_data().data(), size);
+                            m_archive.position() += size;
+                            return bits::errc{};
+                        }
+                    }
+                    return m_archive(bits::unsized(item));
+                } else {
+                    if constexpr (!is_trusted) {
+                        if (length > m_archive.remaining_data().size()) [[unlikely]] {
+                            return bits::errc{std::errc::result_out_of_range};
+                        }
+                    }
+                    if constexpr (requires { item.reserve(1); }) {
+                        item.reserve(length);
+                    }
+
+                    auto end_position = length + m_archive.position();
+                    while (m_archive.position() < end_position) {
+                        if (auto result = fetch(); failure(result)) [[unlikely]] {
+                            return result;
+                        }
+                    }
+
+                    if constexpr (is_padded) {
+                        if (m_archive.position() > m_archive.data().size())
+                            [[unlikely]] {
+                            return bits::errc{std::errc::result_out_of_range};
+                        }
+                    }
+                    return bits::errc{};
+                }
+            } else if constexpr (concepts::interned_field<value_type>) {
+                value_type value;
+                if (auto result = deserialize_field<Mask>(field_type, value);
+                    failure(result)) [[unlikely]] {
+                    return result;
+                }
+                item.push_back(value);
+                return bits::errc{};
+            } else {
+                std::aligned_storage_t<sizeof(value_type), alignof(value_type)> storage;
+
+                auto object =
+                    bits::access::placement_new<value_type>(std::addressof(storage));
+                bits::destructor_guard guard{*object};
+                if (auto result = serialize_one<bits::varint<uint32_t>, Mask>(*object);
+                    failure(result)) [[unlikely]] {
+                    return result;
+                }
+
+                if constexpr (requires { item.push_back(std::move(*object)); }) {
+                    item.push_back(std::move(*object));
+                } else {
+                    item.insert(std::move(*object));
+                }
+
+                return bits::errc{};
+            }
+        }
+    }
+
+    template <typename SizeType = default_size_type, typename Mask = void>
+    ZPP_BITS_INLINE constexpr bits::errc serialize_one(auto &item)
+    {
+        // using type = std::remove_cvref_t<decltype(item)>;
+        if constexpr (!std::is_void_v<SizeType>) {
+            SizeType size{};
+            if (auto result = read_length(size); failure(result)) [[unlikely]] {
+                return result;
+            }
+            if constexpr (!is_trusted) {
+                if (size > m_archive.remaining_data().size()) [[unlikely]]
+                    return bits::errc{std::errc::message_size};
+            }
+
+            return deserialize_fields<Mask>(item, m_archive.position() + size);
+        } else
+            return deserialize_fields<Mask>(item, m_archive.data().size());
+    }
+
+    // Reads a varint or fixed-width value, with trusted or padded input it
+    // is loaded without a size check.
+    template <typename Type>
+    ZPP_BITS_INLINE constexpr bits::errc read_scalar(Type &item)
+    {
+        if constexpr ((is_trusted || is_padded) &&
+                      std::endian::native == std::endian::little &&
+                      (bits::concepts::varint<Type> ||
+                       std::is_arithmetic_v<Type>)) {
+            if (!std::is_constant_evaluated()) {
+                auto data = reinterpret_cast<const std::byte *>(
+                    m_archive.data().data()) + m_archive.position();
+                if constexpr (bits::concepts::varint<Type>) {
+                    auto size = decode_varint_unchecked(data, item);
+                    if constexpr (is_padded) {
+                        if (std::to_integer<unsigned>(data[size - 1]) >= 0x80)
+                            [[unlikely]] {
+                            return std::errc::value_too_large;
+                        }
+                    }
+                    m_archive.position() += size;
+                } else {
+                    std::memcpy(&item, data, sizeof(item));
+                    m_archive.position() += sizeof(item);
+                }
+                return {};
+            }
+        }
+        return m_archive(item);
+    }
+
+private:
+    ZPP_BITS_INLINE constexpr static void reset_member(auto &member)
+    {
+        using type = std::remove_cvref_t<decltype(member)>;
+        if constexpr (bits::concepts::container<type> &&
+                      !std::is_fundamental_v<type> &&
+                      !std::same_as<type, std::byte> &&
+                      requires { member.clear(); }) {
+            member.clear();
+        } else if constexpr (bits::concepts::optional<type> || bits::concepts::owning_pointer<type>) {
+            member.reset();
+        } else if constexpr (concepts::columns_field<type>) {
+            member.clear();
+        } else if constexpr (concepts::cached_message<type> ||
+                             concepts::pre_encoded_message<type> ||
+                             concepts::interned_field<type>) {
+            member = type{};
+        } else if constexpr (std::is_fundamental_v<type>) {
+            member = 0;
+        } else if constexpr (bits::concepts::varint<type>) {
+            member = static_cast<typename type::value_type>(0);
+        }
+    }
+
+    // Skips a varint of at most the size of a Type varint.
+    template <typename Type = std::uint64_t>
+    ZPP_BITS_INLINE constexpr bits::errc skip_varint()
+    {
+        constexpr auto max_size = bits::varint_max_size<Type>;
+        if constexpr (is_trusted || is_padded) {
+            if (!std::is_constant_evaluated()) {
+                auto data = reinterpret_cast<const std::byte *>(
+                                m_archive.data().data()) +
+                            m_archive.position();
+                std::size_t size = 1;
+                while (std::to_integer<unsigned>(data[size - 1]) >= 0x80 &&
+                       size < max_size) {
+                    ++size;
+                }
+                if constexpr (is_padded) {
+                    if (std::to_integer<unsigned>(data[size - 1]) >= 0x80)
+                        [[unlikely]] {
+                        return std::errc::value_too_large;
+                    }
+                }
+                m_archive.position() += size;
+                return {};
+            }
+        }
+
+        auto data = m_archive.remaining_data();
+        auto size = std::min(data.size(), max_size);
+        for (std::size_t i = 0; i < size; ++i) {
+            if (!(std::to_integer<unsigned>(std::byte(data[i])) & 0x80)) {
+                m_archive.position() += i + 1;
+                return {};
+            }
+        }
+        return data.size() < max_size ? std::errc::result_out_of_range
+                                      : std::errc::value_too_large;
+    }
+
+    // Decodes a varint without looking at the buffer size, the terminating
+    // byte is assumed to be present, returns the number of bytes consumed.
+    template <typename Type, bits::varint_encoding Encoding>
+    ZPP_BITS_INLINE static std::size_t
+    decode_varint_unchecked(const std::byte *data,
+                            bits::varint<Type, Encoding> &item)
+    {
+        using value_type = std::conditional_t<
+            std::is_enum_v<Type>,
+            std::make_unsigned_t<bits::traits::underlying_type_t<Type>>,
+            std::make_unsigned_t<Type>>;
+
+        value_type value{};
+        std::size_t position = 0;
+        for (std::size_t shift = 0; shift < sizeof(value_type) * CHAR_BIT;
+             shift += CHAR_BIT - 1) {
+            auto next_byte = value_type(data[position++]);
+            value |= (next_byte & 0x7f) << shift;
+            if (next_byte < 0x80) [[likely]] {
+                break;
+            }
+        }
+
+        if constexpr (bits::varint_encoding::zig_zag == Encoding) {
+            item.value = decltype(item.value)((value >> 1) ^ -(value & 0x1));
+        } else {
+            item.value = decltype(item.value)(value);
+        }
+        return position;
+    }
+
+    template <typename Type>
+    constexpr bits::errc validate_fields(std::size_t end_position)
+    {
+        static_assert(check_type<Type>());
+
+        while (m_archive.position() < end_position) {
+            bits::vuint32_t tag;
+            if (auto result = m_archive(tag); failure(result)) [[unlikely]] {
+                return result;
+            }
+
+            if (auto result = validate_field<Type>(tag_number(tag),
+                                                   proto::tag_type(tag));
+                failure(result)) [[unlikely]] {
+                return result;
+            }
+        }
+
+        if (m_archive.position() != end_position) [[unlikely]] {
+            return std::errc::result_out_of_range;
+        }
+        return {};
+    }
+
+    template <typename Type, std::size_t Index = 0>
+    constexpr bits::errc validate_field(auto field_num, wire_type field_type)
+    {
+        if constexpr (Index >= bits::number_of_members<Type>()) {
+            if (!field_num) [[unlikely]] {
+                return std::errc::protocol_error;
+            }
+            return skip_field(field_type);
+        } else if (proto::field_num<Type, Index>() != field_num) {
+            return validate_field<Type, Index + 1>(field_num, field_type);
+        } else {
+            return validate_member<member_type_t<Type, Index>>(field_type);
+        }
+    }
+
+    template <typename Type>
+    constexpr bits::errc validate_member(wire_type field_type)
+    {
+        using type = std::remove_cvref_t<Type>;
+
+        if constexpr (bits::concepts::empty<type>) {
+            return skip_field(field_type);
+        } else if constexpr (std::same_as<type, bool>) {
+            std::byte value{};
+            if (field_type != wire_type::varint) [[unlikely]] {
+                return std::errc::protocol_error;
+            }
+            if (auto result = m_archive(value); failure(result)) [[unlikely]] {
+                return result;
+            }
+            if (std::to_integer<unsigned>(value) > 1) [[unlikely]] {
+                return std::errc::protocol_error;
+            }
+            return {};
+        } else if constexpr (!concepts::is_length_delimited<type> ||
+                             std::is_enum_v<type>) {
+            if (field_type != tag_type<type>()) [[unlikely]] {
+                return std::errc::protocol_error;
+            }
+            if constexpr (tag_type<type>() == wire_type::varint) {
+                return skip_varint<varint_value_t<type>>();
+            } else {
+                return skip_field(field_type);
+            }
+        } else if constexpr (requires(type & item) { type::serialize(*this, item); } ||
+                             requires(type & item) { serialize(*this, item); }) {
+            return skip_field(field_type);
+        } else if constexpr (bits::concepts::optional<type> ||
+                             concepts::cached_message<type> ||
+                             concepts::pre_encoded_message<type> ||
+                             concepts::sink_field<type> ||
+                             concepts::columns_field<type>) {
+            return validate_member<typename type::value_type>(field_type);
+        } else if constexpr (concepts::interned_field<type>) {
+            return validate_member<std::string>(field_type);
+        } else {
+            if constexpr (bits::concepts::container<type> &&
+                          !bits::concepts::associative_container<type>) {
+                using value_type = typename type::value_type;
+                if constexpr (!concepts::is_length_delimited<value_type> ||
+                              std::is_enum_v<value_type>) {
+                    if constexpr (sizeof(value_type) != 1) {
+                        if (field_type != wire_type::length_delimited) {
+                            return validate_member<value_type>(field_type);
+                        }
+                    }
+                }
+            }
+
+            if (field_type != wire_type::length_delimited) [[unlikely]] {
+                return std::errc::protocol_error;
+            }
+            bits::vsize_t length;
+            if (auto result = m_archive(length); failure(result)) [[unlikely]] {
+                return result;
+            }
+            if (length > m_archive.remaining_data().size()) [[unlikely]] {
+                return std::errc::result_out_of_range;
+            }
+            auto end_position = m_archive.position() + length;
+
+            if constexpr (!bits::concepts::container<type>) {
+                return validate_fields<type>(end_position);
+            } else if constexpr (bits::concepts::associative_container<type> &&
+                                 requires { typename type::mapped_type; }) {
+                return validate_fields<map_entry<type>>(end_position);
+            } else {
+                using value_type = typename type::value_type;
+                if constexpr (std::is_fundamental_v<value_type> ||
+                              std::same_as<value_type, std::byte>) {
+                    if (length % sizeof(value_type)) [[unlikely]] {
+                        return std::errc::protocol_error;
+                    }
+                    m_archive.position() = end_position;
+                    return {};
+                } else if constexpr (bits::concepts::varint<value_type> ||
+                                     std::is_enum_v<value_type>) {
+                    while (m_archive.position() < end_position) {
+                        if (auto result =
+                                skip_varint<varint_value_t<value_type>>();
+                            failure(result)) [[unlikely]] {
+                            return result;
+                        }
+                    }
+                    if (m_archive.position() != end_position) [[unlikely]] {
+                        return std::errc::result_out_of_range;
+                    }
+                    return {};
+                } else if constexpr (bits::concepts::container<value_type> ||
+                                     concepts::interned_field<value_type>) {
+                    m_archive.position() = end_position;
+                    return {};
+                } else {
+                    return validate_fields<value_type>(end_position);
+                }
+            }
+        }
+    }
+};
+template <typename Type, std::size_t Size, typename... Options>
+in(Type (&)[Size], Options &&...) -> in<std::span<Type, Size>, Options...>;
+
+template <typename Type, typename SizeType, typename... Options>
+in(bits::sized_item<Type, SizeType> &, Options &&...)
+    -> in<Type, Options...>;
+
+template <typename Type, typename SizeType, typename... Options>
+in(const bits::sized_item<Type, SizeType> &, Options &&...)
+    -> in<const Type, Options...>;
+
+template <typename Type, typename SizeType, typename... Options>
+in(bits::sized_item<Type, SizeType> &&, Options &&...)
+    -> in<Type, Options...>;
+
+constexpr auto input(auto &&view, auto &&...option)
+{
+    return in(std::forward<decltype(view)>(view),
+              std::forward<decltype(option)>(option)...);
+}
+
+constexpr auto output(auto &&view, auto &&...option)
+{
+    return out(std::forward<decltype(view)>(view),
+               std::forward<decltype(option)>(option)...);
+}
+
+constexpr auto in_out(auto &&view, auto &&...option)
+{
+    return std::tuple{
+        in<std::remove_reference_t<typename decltype(in{view})::view_type>,
+           decltype(option) &...>(view, option...),
+        out(std::forward<decltype(view)>(view),
+            std::forward<decltype(option)>(option)...)};
+}
+
+template <typename ByteType = std::byte>
+constexpr auto data_in_out(auto &&...option)
+{
+    struct data_in_out
+    {
+        data_in_out(decltype(option) &&...option) :
+            input(data, option...),
+            output(data,
+                   std::forward<decltype(option)>(option)...)
+        {
+        }
+
+        std::vector<ByteType> data;
+        in<decltype(data), decltype(option) &...> input;
+        out<decltype(data), decltype(option)...> output;
+    };
+    return data_in_out{std::forward<decltype(option)>(option)...};
+}
+
+template <typename ByteType = std::byte>
+constexpr auto data_in(auto &&...option)
+{
+    struct data_in
+    {
+        data_in(decltype(option) &&...option) :
+            input(data,
+                  std::forward<decltype(option)>(option)...)
+        {
+        }
+
+        std::vector<ByteType> data;
+        in<decltype(data), decltype(option)...> input;
+    };
+    return data_in{std::forward<decltype(option)>(option)...};
+}
+
+template <typename ByteType = std::byte>
+constexpr auto data_out(auto &&...option)
+{
+    struct data_out
+    {
+        data_out(decltype(option) &&...option) :
+            output(data,
+                   std::forward<decltype(option)>(option)...)
+        {
+        }
+
+        std::vector<ByteType> data;
+        out<decltype(data), decltype(option)...> output;
+    };
+    return data_out{std::forward<decltype(option)>(option)...};
+}
+
+// Walks the buffer once and checks that it is a well formed encoding of
+// Type, such that it can later be decoded with the trusted option.
+template <typename Type>
+constexpr bits::errc validate(auto &&view, auto &&...option)
+{
+    return in(std::forward<decltype(view)>(view),
+              std::forward<decltype(option)>(option)...)
+        .template validate<Type>();
+}
+
+// Encodes messages into one buffer as the varint message count, the varint
+// length of every message and then the messages back to back, the buffer
+// is enlarged once for the whole batch.
+template <typename Type, std::size_t Extent>
+constexpr bits::errc serialize_batch(auto &&view,
+                                     std::span<Type, Extent> messages,
+                                     auto &&...option)
+{
+    std::vector<std::size_t> sizes(messages.size());
+    std::size_t total = bits::varint_size(messages.size());
+    bits::errc error;
+    for (std::size_t i = 0; i < messages.size(); ++i) {
+        sizes[i] = message_size(messages[i], error);
+        total += length_delimited_size(sizes[i]);
+    }
+    if (failure(error)) [[unlikely]] {
+        return error;
+    }
+
+    out output(std::forward<decltype(view)>(view),
+               std::forward<decltype(option)>(option)...);
+    auto end = output.m_archive.data().size();
+    if constexpr (decltype(output)::resizable) {
+        if (auto result = output.m_archive.enlarge_for(total); failure(result))
+            [[unlikely]] {
+            return result;
+        }
+    } else if (total > end - output.position()) [[unlikely]] {
+        return std::errc::result_out_of_range;
+    }
+
+    if (auto result = output.m_archive(bits::varint{messages.size()});
+        failure(result)) [[unlikely]] {
+        return result;
+    }
+    for (auto size : sizes) {
+        if (auto result = output.m_archive(bits::varint{size}); failure(result))
+            [[unlikely]] {
+            return result;
+        }
+    }
+    for (auto &message : messages) {
+        if (auto result = output.serialize_unsized(message); failure(result))
+            [[unlikely]] {
+            return result;
+        }
+    }
+
+    if constexpr (decltype(output)::resizable) {
+        if (output.position() >= end) {
+            output.m_archive.data().resize(output.position());
+        }
+    }
+    return {};
+}
+
+// The number of messages in a batch written by serialize_batch().
+constexpr bits::value_or_errc<std::size_t> batch_size(auto &&view,
+                                                      auto &&...option)
+{
+    in input(std::forward<decltype(view)>(view),
+             std::forward<decltype(option)>(option)...);
+    bits::vsize_t count;
+    if (auto result = input.read_length(count); failure(result)) [[unlikely]] {
+        return bits::value_or_errc<std::size_t>{result};
+    }
+    return bits::value_or_errc<std::size_t>{std::size_t(count)};
+}
+
+// Decodes a batch written by serialize_batch() into messages, which must
+// hold exactly batch_size() messages. The length index is walked alongside
+// the messages by a single archive.
+template <typename Type, std::size_t Extent>
+constexpr bits::errc deserialize_batch(auto &&view,
+                                       std::span<Type, Extent> messages,
+                                       auto &&...option)
+{
+    in input(std::forward<decltype(view)>(view),
+             std::forward<decltype(option)>(option)...);
+    using input_type = decltype(input);
+
+    bits::vsize_t count;
+    if (auto result = input.read_length(count); failure(result)) [[unlikely]] {
+        return result;
+    }
+    if (count != messages.size()) [[unlikely]] {
+        return std::errc::invalid_argument;
+    }
+
+    auto index = input.position();
+    for (std::size_t i = 0; i < count; ++i) {
+        bits::vsize_t length;
+        if (auto result = input.read_length(length); failure(result))
+            [[unlikely]] {
+            return result;
+        }
+    }
+
+    auto body = input.position();
+    auto size = body + input.remaining_data().size();
+    for (auto &message : messages) {
+        bits::vsize_t length;
+        input.position() = index;
+        if (auto result = input.read_length(length); failure(result))
+            [[unlikely]] {
+            return result;
+        }
+        index = input.position();
+
+        if constexpr (!input_type::is_trusted) {
+            if (length > size - body) [[unlikely]] {
+                return std::errc::message_size;
+            }
+        }
+        input.position() = body;
+        body += length;
+        if (auto result =
+                input.template deserialize_fields<
+                    typename input_type::field_mask_type>(message, body);
+            failure(result)) [[unlikely]] {
+            return result;
+        }
+    }
+    return {};
+}
+
+template <auto Object, std::size_t MaxSize = 0x1000>
+constexpr auto to_bytes()
+{
+    constexpr auto size = [] {
+        std::array<std::byte, MaxSize> data;
+        out out{data};
+        out(Object).or_throw();
+        return out.position();
+    }();
+
+    if constexpr (!size) {
+        return bits::string_literal<std::byte, 0>{};
+    } else {
+        std::array<std::byte, size> data;
+        out{data}(Object).or_throw();
+        return data;
+    }
+}
+
+template <auto Data, typename Type>
+constexpr auto from_bytes()
+{
+    Type object;
+    in{Data}(object).or_throw();
+    return object;
+}
+
+template <typename Type>
+constexpr auto unwrap_optional()
+{
+    if constexpr (bits::concepts::optional<Type>) {
+        return std::type_identity<typename Type::value_type>{};
+    } else {
+        return std::type_identity<Type>{};
+    }
+}
+
+// The member type of the field with the given number, without optional.
+template <typename Type, auto FieldNumber>
+using field_member_t = typename decltype(unwrap_optional<
+    member_type_t<Type, member_index<Type, FieldNumber>()>>())::type;
+
+// The type of a single value of a field: the element of a repeated field.
+template <typename Type>
+constexpr auto field_element()
+{
+    if constexpr (concepts::repeated_field<Type>) {
+        return std::type_identity<typename Type::value_type>{};
+    } else {
+        return std::type_identity<Type>{};
+    }
+}
+
+template <typename Type>
+using field_element_t = typename decltype(field_element<Type>())::type;
+
+// Walks the encoded bytes of Type along a path of field numbers, and stops
+// at every occurrence of the last field, repeated fields on the way are
+// walked element by element. Nothing is materialized: scalars are decoded
+// on their own, strings/bytes and sub-messages are views of the input.
+template <typename ByteType, typename Type, auto... Path>
+class path_cursor
+{
+public:
+    constexpr static std::size_t depth = sizeof...(Path);
+    static_assert(depth != 0);
+
+    constexpr static std::array<std::uint32_t, depth> path{
+        {std::uint32_t(Path)...}};
+
+    template <std::size_t Level>
+    constexpr static auto level()
+    {
+        if constexpr (Level == 0) {
+            return std::type_identity<Type>{};
+        } else {
+            using parent = typename decltype(level<Level - 1>())::type;
+            return std::type_identity<field_element_t<
+                field_member_t<parent, path[Level - 1]>>>{};
+        }
+    }
+
+    template <std::size_t Level>
+    using level_type = typename decltype(level<Level>())::type;
+
+    template <std::size_t Level>
+    using level_member_type = field_member_t<level_type<Level>, path[Level]>;
+
+    using member_type = level_member_type<depth - 1>;
+    using element_type = field_element_t<member_type>;
+
+    constexpr static bool packable =
+        concepts::repeated_field<member_type> &&
+        (!concepts::is_length_delimited<element_type> ||
+         std::is_enum_v<element_type>);
+
+    constexpr static bool repeated = []<std::size_t... Levels>(
+        std::index_sequence<Levels...>) {
+        return (... || concepts::repeated_field<level_member_type<Levels>>);
+    }(std::make_index_sequence<depth>{});
+
+    constexpr static auto value()
+    {
+        if constexpr (!concepts::is_length_delimited<element_type> ||
+                      std::is_enum_v<element_type>) {
+            return std::type_identity<element_type>{};
+        } else if constexpr (requires {
+                                 requires concepts::bytes_field<element_type>;
+                                 requires std::same_as<
+                                     typename element_type::value_type, char>;
+                             }) {
+            return std::type_identity<std::string_view>{};
+        } else if constexpr (concepts::interned_field<element_type>) {
+            return std::type_identity<std::string_view>{};
+        } else {
+            return std::type_identity<std::span<const ByteType>>{};
+        }
+    }
+
+    using value_type = typename decltype(value())::type;
+
+    constexpr explicit path_cursor(std::span<const ByteType> data) :
+        m_in(std::move(data))
+    {
+        m_end[0] = m_in.remaining_data().size();
+    }
+
+    constexpr bool next()
+    {
+        auto resume = m_started;
+        m_started = true;
+        if (failure(m_error)) [[unlikely]] {
+            return false;
+        }
+        return advance<0>(resume);
+    }
+
+    constexpr const value_type &current() const
+    {
+        return m_value;
+    }
+
+    constexpr bits::errc error() const
+    {
+        return m_error;
+    }
+
+    constexpr std::size_t position() const
+    {
+        return m_in.position();
+    }
+
+private:
+    template <std::size_t Level>
+    constexpr bool advance(bool resume)
+    {
+        if constexpr (Level == depth) {
+            // Elements of a packed last field.
+            if (m_in.position() >= m_end[depth]) {
+                return false;
+            }
+            m_level = depth;
+            return read_value(tag_type<element_type>());
+        } else {
+            if (resume && m_level > Level) {
+                if (advance<Level + 1>(true)) {
+                    return true;
+                }
+                if (failure(m_error)) [[unlikely]] {
+                    return false;
+                }
+            }
+            m_level = Level;
+
+            while (m_in.position() < m_end[Level]) {
+                std::uint32_t field_number;
+                wire_type field_type;
+                if (auto result = m_in.read_tag(field_number, field_type);
+                    failure(result)) [[unlikely]] {
+                    m_error = result;
+                    return false;
+                }
+
+                if (field_number != path[Level]) {
+                    if (auto result = m_in.skip_field(field_type);
+                        failure(result)) [[unlikely]] {
+                        m_error = result;
+                        return false;
+                    }
+                    continue;
+                }
+
+                if constexpr (Level + 1 < depth) {
+                    if (!enter(field_type, m_end[Level + 1])) [[unlikely]] {
+                        return false;
+                    }
+                    if (advance<Level + 1>(false)) {
+                        return true;
+                    }
+                    if (failure(m_error)) [[unlikely]] {
+                        return false;
+                    }
+                    m_level = Level;
+                } else {
+                    if constexpr (packable) {
+                        if (field_type == wire_type::length_delimited) {
+                            if (!enter(field_type, m_end[depth])) [[unlikely]] {
+                                return false;
+                            }
+                            if (advance<depth>(false)) {
+                                return true;
+                            }
+                            if (failure(m_error)) [[unlikely]] {
+                                return false;
+                            }
+                            m_level = Level;
+                            continue;
+                        }
+                    }
+                    return read_value(field_type);
+                }
+            }
+            return false;
+        }
+    }
+
+    constexpr bool enter(wire_type field_type, std::size_t &end_position)
+    {
+        if (field_type != wire_type::length_delimited) [[unlikely]] {
+            m_error = std::errc::protocol_error;
+            return false;
+        }
+        bits::vsize_t length;
+        if (auto result = m_in.read_length(length); failure(result))
+            [[unlikely]] {
+            m_error = result;
+            return false;
+        }
+        if (length > m_in.remaining_data().size()) [[unlikely]] {
+            m_error = std::errc::result_out_of_range;
+            return false;
+        }
+        end_position = m_in.position() + length;
+        return true;
+    }
+
+    constexpr bool read_value(wire_type field_type)
+    {
+        if constexpr (!concepts::is_length_delimited<element_type> ||
+                      std::is_enum_v<element_type>) {
+            if (field_type != tag_type<element_type>()) [[unlikely]] {
+                m_error = std::errc::protocol_error;
+                return false;
+            }
+            if (auto result = m_in.deserialize_field(field_type, m_value);
+                failure(result)) [[unlikely]] {
+                m_error = result;
+                return false;
+            }
+            return true;
+        } else {
+            std::size_t end_position{};
+            if (!enter(field_type, end_position)) [[unlikely]] {
+                return false;
+            }
+            auto data = m_in.remaining_data().data();
+            auto size = end_position - m_in.position();
+            if constexpr (std::same_as<value_type, std::string_view>) {
+                if constexpr (std::same_as<std::remove_cv_t<ByteType>, char>) {
+                    m_value = value_type{data, size};
+                } else {
+                    m_value = value_type{
+                        reinterpret_cast<const char *>(data), size};
+                }
+            } else {
+                m_value = value_type{data, size};
+            }
+            m_in.position() = end_position;
+            return true;
+        }
+    }
 
-            return {};
-        } else if constexpr (requires {
-                                 requires std::is_fundamental_v<
-                                     typename type::value_type> ||
-                                     std::same_as<typename type::value_type,
-                                                  std::byte>;
-                             }) {
-            constexpr auto tag = make_tag<tag_type>(FieldNum);
-            auto size = item.size();
-            if (!size) [[unlikely]] {
+    in<std::span<const ByteType>> m_in;
+    std::array<std::size_t, depth + 1> m_end{};
+    std::size_t m_level{};
+    bool m_started{};
+    value_type m_value{};
+    bits::errc m_error{};
+};
+
+// A forward range over the matches of a path_cursor, iteration stops at
+// the end of the input or at the first malformed field (see error()).
+template <typename Cursor, typename Projection = std::identity>
+class path_range
+{
+public:
+    class iterator
+    {
+    public:
+        using iterator_concept = std::forward_iterator_tag;
+        using value_type = std::remove_cvref_t<decltype(Projection{}(
+            std::declval<const typename Cursor::value_type &>()))>;
+        using difference_type = std::ptrdiff_t;
+
+        constexpr iterator() = default;
+        constexpr explicit iterator(const Cursor &cursor) : m_cursor(cursor)
+        {
+            ++*this;
+        }
+
+        constexpr decltype(auto) operator*() const
+        {
+            return Projection{}(m_cursor->current());
+        }
+
+        constexpr iterator &operator++()
+        {
+            if (!m_cursor->next()) {
+                m_cursor.reset();
+            }
+            return *this;
+        }
+
+        constexpr iterator operator++(int)
+        {
+            auto previous = *this;
+            ++*this;
+            return previous;
+        }
+
+        constexpr bool operator==(const iterator &other) const
+        {
+            if (!m_cursor || !other.m_cursor) {
+                return !m_cursor == !other.m_cursor;
+            }
+            return m_cursor->position() == other.m_cursor->position();
+        }
+
+        constexpr bool operator==(std::default_sentinel_t) const
+        {
+            return !m_cursor;
+        }
+
+    private:
+        std::optional<Cursor> m_cursor;
+    };
+
+    constexpr explicit path_range(Cursor cursor) : m_cursor(std::move(cursor))
+    {
+    }
+
+    constexpr iterator begin() const
+    {
+        return iterator{m_cursor};
+    }
+
+    constexpr std::default_sentinel_t end() const
+    {
+        return {};
+    }
+
+    // The error that stopped the iteration, if any, walks the input again.
+    constexpr bits::errc error() const
+    {
+        auto cursor = m_cursor;
+        while (cursor.next()) {
+        }
+        return cursor.error();
+    }
+
+private:
+    Cursor m_cursor;
+};
+
+// Extracts the field at the given path of field numbers from the encoded
+// bytes of Type without decoding anything else. A path that goes through
+// (or ends at) a repeated field returns an input range over all the
+// matches, otherwise the value of the last occurrence (or the default
+// value) is returned in a value_or_errc. Strings and bytes are returned as
+// views of the input, sub-messages as the span of their encoded bytes.
+template <typename Type, auto... Path>
+constexpr auto extract(auto &&view)
+{
+    using byte_type = std::remove_cvref_t<decltype(*std::data(view))>;
+    using cursor_type = path_cursor<byte_type, Type, Path...>;
+    cursor_type cursor{std::span<const byte_type>{std::data(view),
+                                                  std::size(view)}};
+
+    if constexpr (cursor_type::repeated) {
+        return path_range<cursor_type>{std::move(cursor)};
+    } else {
+        using value_type = typename cursor_type::value_type;
+        value_type value{};
+        while (cursor.next()) {
+            value = cursor.current();
+        }
+        if (failure(cursor.error())) [[unlikely]] {
+            return bits::value_or_errc<value_type>{cursor.error()};
+        }
+        return bits::value_or_errc<value_type>{std::move(value)};
+    }
+}
+
+// Walks a stream of records each prefixed by its size as a varint, as out
+// writes them with the bits::size_varint option, and stops at every record.
+template <typename ByteType>
+class record_cursor
+{
+public:
+    using value_type = std::span<const ByteType>;
+
+    constexpr explicit record_cursor(std::span<const ByteType> data) :
+        m_in(std::move(data))
+    {
+    }
+
+    constexpr bool next()
+    {
+        if (m_in.remaining_data().empty()) {
+            return false;
+        }
+        bits::vsize_t length;
+        if (auto result = m_in.read_length(length); failure(result))
+            [[unlikely]] {
+            m_error = result;
+            return false;
+        }
+        auto data = m_in.remaining_data();
+        if (length > data.size()) [[unlikely]] {
+            m_error = std::errc::result_out_of_range;
+            return false;
+        }
+        m_value = value_type{data.data(), length};
+        m_in.position() += length;
+        return true;
+    }
+
+    constexpr const value_type &current() const
+    {
+        return m_value;
+    }
+
+    constexpr std::size_t position() const
+    {
+        return m_in.position();
+    }
+
+    constexpr bits::errc error() const
+    {
+        return m_error;
+    }
+
+private:
+    in<std::span<const ByteType>> m_in;
+    value_type m_value{};
+    bits::errc m_error{};
+};
+
+namespace concepts
+{
+template <typename Type>
+concept record_predicate = requires { typename Type::record_predicate; };
+} // namespace concepts
+
+// Tests the value of the field at Path of a record with test, which sees
+// varints as their value and strings as string_view. A repeated field
+// matches when any element does. A record whose field is malformed does
+// not match.
+template <typename Test, auto... Path>
+struct field_predicate
+{
+    using record_predicate = void;
+
+    template <typename Type, typename ByteType>
+    constexpr bool matches(std::span<const ByteType> record) const
+    {
+        auto value = extract<Type, Path...>(record);
+        if constexpr (path_cursor<ByteType, Type, Path...>::repeated) {
+            for (auto &&element : value) {
+                if (check(element)) {
+                    return true;
+                }
+            }
+            return false;
+        } else {
+            return success(value) && check(value.value());
+        }
+    }
+
+    constexpr bool check(const auto &value) const
+    {
+        if constexpr (bits::concepts::varint<
+                          std::remove_cvref_t<decltype(value)>>) {
+            return test(value.value);
+        } else {
+            return test(value);
+        }
+    }
+
+    Test test;
+};
+
+template <typename Left, typename Right, bool All>
+struct predicate_combination
+{
+    using record_predicate = void;
+
+    template <typename Type, typename ByteType>
+    constexpr bool matches(std::span<const ByteType> record) const
+    {
+        if constexpr (All) {
+            return left.template matches<Type>(record) &&
+                   right.template matches<Type>(record);
+        } else {
+            return left.template matches<Type>(record) ||
+                   right.template matches<Type>(record);
+        }
+    }
+
+    Left left;
+    Right right;
+};
+
+template <concepts::record_predicate Left, concepts::record_predicate Right>
+constexpr auto operator&&(Left left, Right right)
+{
+    return predicate_combination<Left, Right, true>{std::move(left),
+                                                    std::move(right)};
+}
+
+template <concepts::record_predicate Left, concepts::record_predicate Right>
+constexpr auto operator||(Left left, Right right)
+{
+    return predicate_combination<Left, Right, false>{std::move(left),
+                                                     std::move(right)};
+}
+
+template <typename Compare, typename Value>
+struct field_compare
+{
+    constexpr bool operator()(const auto &field) const
+    {
+        return Compare{}(field, value);
+    }
+
+    Value value;
+};
+
+template <typename Value>
+struct field_between
+{
+    constexpr bool operator()(const auto &field) const
+    {
+        return !(field < low) && !(high < field);
+    }
+
+    Value low;
+    Value high;
+};
+
+struct field_prefix
+{
+    constexpr bool operator()(std::string_view field) const
+    {
+        return field.starts_with(prefix);
+    }
+
+    std::string_view prefix;
+};
+
+// Names the field at a path of field numbers in a record predicate, such as
+// field_path<2>{} == 5 or field_path<4, 1>{}.starts_with("555").
+template <auto... Path>
+struct field_path
+{
+    template <typename Compare, typename Value>
+    constexpr static auto compare(Value value)
+    {
+        return field_predicate<field_compare<Compare, Value>, Path...>{
+            {std::move(value)}};
+    }
+
+    constexpr auto operator==(auto value) const
+    {
+        return compare<std::equal_to<>>(std::move(value));
+    }
+
+    constexpr auto operator!=(auto value) const
+    {
+        return compare<std::not_equal_to<>>(std::move(value));
+    }
+
+    constexpr auto operator<(auto value) const
+    {
+        return compare<std::less<>>(std::move(value));
+    }
+
+    constexpr auto operator<=(auto value) const
+    {
+        return compare<std::less_equal<>>(std::move(value));
+    }
+
+    constexpr auto operator>(auto value) const
+    {
+        return compare<std::greater<>>(std::move(value));
+    }
+
+    constexpr auto operator>=(auto value) const
+    {
+        return compare<std::greater_equal<>>(std::move(value));
+    }
+
+    // Matches low <= field <= high.
+    template <typename Value>
+    constexpr auto between(Value low, Value high) const
+    {
+        return field_predicate<field_between<Value>, Path...>{
+            {std::move(low), std::move(high)}};
+    }
+
+    constexpr auto starts_with(std::string_view prefix) const
+    {
+        return field_predicate<field_prefix, Path...>{{prefix}};
+    }
+};
+
+template <typename Type, typename ByteType, typename Predicate>
+class filter_cursor
+{
+public:
+    using value_type = std::span<const ByteType>;
+
+    constexpr filter_cursor(std::span<const ByteType> data,
+                            Predicate predicate) :
+        m_records(data), m_predicate(std::move(predicate))
+    {
+    }
+
+    constexpr bool next()
+    {
+        while (m_records.next()) {
+            if (m_predicate.template matches<Type>(m_records.current())) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    constexpr const value_type &current() const
+    {
+        return m_records.current();
+    }
+
+    constexpr std::size_t position() const
+    {
+        return m_records.position();
+    }
+
+    constexpr bits::errc error() const
+    {
+        return m_records.error();
+    }
+
+private:
+    record_cursor<ByteType> m_records;
+    Predicate m_predicate;
+};
+
+template <typename Type>
+struct decode_record
+{
+    constexpr Type operator()(auto record) const
+    {
+        Type object;
+        in{record}(object).or_throw();
+        return object;
+    }
+};
+
+// A forward range over the byte spans of the records of a varint
+// delimited stream, see record_cursor.
+constexpr auto records(auto &&stream)
+{
+    using byte_type = std::remove_cvref_t<decltype(*std::data(stream))>;
+    return path_range<record_cursor<byte_type>>{record_cursor<byte_type>{
+        std::span<const byte_type>{std::data(stream), std::size(stream)}}};
+}
+
+// A forward range over the byte spans of the records of a varint
+// delimited stream of Type that match predicate, built from field_path.
+// Only the fields the predicate references are read from each record, and
+// rejected records are never decoded.
+template <typename Type>
+constexpr auto filter(auto &&stream, concepts::record_predicate auto predicate)
+{
+    using byte_type = std::remove_cvref_t<decltype(*std::data(stream))>;
+    using cursor_type = filter_cursor<Type, byte_type, decltype(predicate)>;
+    return path_range<cursor_type>{cursor_type{
+        std::span<const byte_type>{std::data(stream), std::size(stream)},
+        std::move(predicate)}};
+}
+
+// Like filter(), the matching records are decoded into Type objects, a
+// malformed record throws.
+template <typename Type>
+constexpr auto filter_objects(auto &&stream,
+                              concepts::record_predicate auto predicate)
+{
+    using byte_type = std::remove_cvref_t<decltype(*std::data(stream))>;
+    using cursor_type = filter_cursor<Type, byte_type, decltype(predicate)>;
+    return path_range<cursor_type, decode_record<Type>>{cursor_type{
+        std::span<const byte_type>{std::data(stream), std::size(stream)},
+        std::move(predicate)}};
+}
+
+// A key and the offset of its record in a run, see sort_records().
+struct sort_entry
+{
+    std::uint64_t key;
+    std::uint64_t offset;
+};
+
+// Maps a scalar to an unsigned key with the same order: the sign bit of
+// signed integers is flipped, negative floating point values are inverted.
+template <typename Type>
+constexpr std::uint64_t sort_key(Type value)
+{
+    if constexpr (bits::concepts::varint<Type>) {
+        return sort_key(value.value);
+    } else if constexpr (std::is_enum_v<Type>) {
+        return sort_key(std::underlying_type_t<Type>(value));
+    } else if constexpr (std::is_floating_point_v<Type>) {
+        using bits_type = std::conditional_t<sizeof(Type) == 4,
+                                             std::uint32_t, std::uint64_t>;
+        constexpr auto sign = bits_type(1) << (sizeof(Type) * 8 - 1);
+        auto key = std::bit_cast<bits_type>(value);
+        return (key & sign) ? bits_type(~key) : bits_type(key | sign);
+    } else if constexpr (std::is_signed_v<Type>) {
+        return std::uint64_t(std::int64_t(value)) ^ (std::uint64_t(1) << 63);
+    } else {
+        return std::uint64_t(value);
+    }
+}
+
+// Sorts entries by key with a stable LSD radix sort, a byte per pass,
+// passes where all the keys share the byte are skipped.
+inline void radix_sort(std::vector<sort_entry> &entries,
+                       std::vector<sort_entry> &scratch)
+{
+    scratch.resize(entries.size());
+    for (std::size_t shift = 0; shift < 64; shift += 8) {
+        std::array<std::size_t, 256> counts{};
+        for (auto &entry : entries) {
+            ++counts[(entry.key >> shift) & 0xff];
+        }
+        if (std::ranges::find(counts, entries.size()) != counts.end()) {
+            continue;
+        }
+        std::size_t offset = 0;
+        for (auto &count : counts) {
+            offset += std::exchange(count, offset);
+        }
+        for (auto &entry : entries) {
+            scratch[counts[(entry.key >> shift) & 0xff]++] = entry;
+        }
+        entries.swap(scratch);
+    }
+}
+
+inline std::size_t read_some(std::istream &input, std::byte *data,
+                             std::size_t size)
+{
+    input.read(reinterpret_cast<char *>(data), std::streamsize(size));
+    return std::size_t(input.gcount());
+}
+
+inline std::size_t read_some(std::FILE *input, std::byte *data,
+                             std::size_t size)
+{
+    return std::fread(data, 1, size, input);
+}
+
+inline bool read_failed(std::istream &input)
+{
+    return input.bad();
+}
+
+inline bool read_failed(std::FILE *input)
+{
+    return std::ferror(input);
+}
+
+inline bool write_bytes(std::ostream &output, const std::byte *data,
+                        std::size_t size)
+{
+    output.write(reinterpret_cast<const char *>(data), std::streamsize(size));
+    return output.good();
+}
+
+inline bool write_bytes(std::FILE *output, const std::byte *data,
+                        std::size_t size)
+{
+    return std::fwrite(data, 1, size, output) == size;
+}
+
+// Reads varint delimited records from a std::istream & or a std::FILE *
+// a block at a time, see sort_records().
+template <typename Source>
+class record_reader
+{
+public:
+    constexpr static std::size_t block_size = std::size_t(64) << 10;
+
+    explicit record_reader(Source source) :
+        m_source(source), m_block(block_size)
+    {
+    }
+
+    // Appends the next record to buffer, its size prefix included, payload
+    // is set to the offset of the record bytes. at_end is set at a clean
+    // end of input, a truncated record is an error. The record bytes are
+    // read a block at a time, so a corrupt length fails at the end of the
+    // input rather than being allocated up front.
+    bits::errc read(std::vector<std::byte> &buffer, std::size_t &payload,
+                    bool &at_end)
+    {
+        constexpr auto max_size = bits::varint_max_size<std::uint64_t>;
+        std::uint64_t length = 0;
+        for (std::size_t shift = 0;; shift += 7) {
+            if (m_position == m_size && !fill()) {
+                if (read_failed(m_source)) [[unlikely]] {
+                    return std::errc::io_error;
+                }
+                if (shift) [[unlikely]] {
+                    return std::errc::result_out_of_range;
+                }
+                at_end = true;
                 return {};
             }
-            if (auto result = m_archive(
-                    tag, bits::varint{size * sizeof(typename type::value_type)},
-                    bits::unsized(std::forward<decltype(item)>(item)));
-                failure(result)) [[unlikely]] {
+            if (shift >= 7 * max_size) [[unlikely]] {
+                return std::errc::protocol_error;
+            }
+            auto byte = std::to_integer<std::uint8_t>(m_block[m_position]);
+            buffer.push_back(m_block[m_position++]);
+            length |= std::uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+        if (length > buffer.max_size() - buffer.size()) [[unlikely]] {
+            return std::errc::message_size;
+        }
+
+        payload = buffer.size();
+        auto buffered = std::size_t(
+            std::min<std::uint64_t>(length, m_size - m_position));
+        buffer.insert(buffer.end(), m_block.begin() + m_position,
+                      m_block.begin() + m_position + buffered);
+        m_position += buffered;
+        length -= buffered;
+        while (length) {
+            auto size =
+                std::size_t(std::min<std::uint64_t>(length, block_size));
+            auto offset = buffer.size();
+            buffer.resize(offset + size);
+            if (read_some(m_source, buffer.data() + offset, size) != size)
+                [[unlikely]] {
+                return read_failed(m_source)
+                           ? std::errc::io_error
+                           : std::errc::result_out_of_range;
+            }
+            length -= size;
+        }
+        return {};
+    }
+
+private:
+    bool fill()
+    {
+        m_position = 0;
+        m_size = read_some(m_source, m_block.data(), m_block.size());
+        return m_size;
+    }
+
+    Source m_source;
+    std::vector<std::byte> m_block;
+    std::size_t m_position = 0;
+    std::size_t m_size = 0;
+};
+
+template <typename Type, auto... Path>
+inline bits::errc record_sort_key(std::span<const std::byte> record,
+                                  std::uint64_t &key)
+{
+    auto value = extract<Type, Path...>(record);
+    if (failure(value)) [[unlikely]] {
+        return value.error();
+    }
+    key = sort_key(value.value());
+    return {};
+}
+
+// Sorts a stream of varint delimited records of Type (see records()) by the
+// scalar field at Path. Only the key field is read from each record, and
+// records are moved as opaque bytes. Records are read in runs of about
+// run_size bytes. Each run is indexed by (key, offset) entries that are
+// radix sorted. Runs are spilled to temporary files, then merged k-way
+// into output. A single run is written out directly. The sort is stable.
+template <typename Type, auto... Path>
+bits::errc sort_records(std::istream &input, std::ostream &output,
+                        std::size_t run_size = std::size_t(64) << 20)
+{
+    using cursor_type = path_cursor<std::byte, Type, Path...>;
+    using key_type = typename cursor_type::value_type;
+    static_assert(!cursor_type::repeated &&
+                      (std::is_arithmetic_v<key_type> ||
+                       std::is_enum_v<key_type> ||
+                       bits::concepts::varint<key_type>),
+                  "the sort key must be a scalar field");
+
+    struct file_close
+    {
+        void operator()(std::FILE *file) const
+        {
+            std::fclose(file);
+        }
+    };
+    using file_type = std::unique_ptr<std::FILE, file_close>;
+
+    auto write_run = [](auto &&destination, const auto &buffer,
+                        const auto &entries) -> bits::errc {
+        for (auto &entry : entries) {
+            auto data = std::span{buffer}.subspan(entry.offset);
+            in<std::span<const std::byte>> prefix{data};
+            bits::vsize_t length;
+            if (auto result = prefix.read_length(length); failure(result))
+                [[unlikely]] {
                 return result;
             }
-            return {};
-        } else if constexpr (requires {
-                                 requires bits::concepts::varint<
-                                     typename type::value_type>;
-                             }) {
-            constexpr auto tag = make_tag<tag_type>(FieldNum);
+            if (!write_bytes(destination, data.data(),
+                             prefix.position() + length))
+                [[unlikely]] {
+                return std::errc::io_error;
+            }
+        }
+        return {};
+    };
 
-            std::size_t size = {};
-            for (auto &element : item) {
-                size += bits::varint_size<type::value_type::encoding>(element.value);
+    record_reader<std::istream &> reader{input};
+    std::vector<std::byte> buffer;
+    std::vector<sort_entry> entries;
+    std::vector<sort_entry> scratch;
+    std::vector<file_type> runs;
+    for (bool at_end = false; !at_end;) {
+        buffer.clear();
+        entries.clear();
+        while (!at_end && buffer.size() < run_size) {
+            auto offset = buffer.size();
+            std::size_t payload{};
+            if (auto result = reader.read(buffer, payload, at_end);
+                failure(result)) [[unlikely]] {
+                return result;
             }
-            if (!size) [[unlikely]] {
-                return {};
+            if (at_end) {
+                break;
             }
-            if (auto result =
-                    m_archive(tag, bits::varint{size},
-                              bits::unsized(std::forward<decltype(item)>(item)));
+            std::uint64_t key{};
+            if (auto result = record_sort_key<Type, Path...>(
+                    std::span{buffer}.subspan(payload), key);
                 failure(result)) [[unlikely]] {
                 return result;
             }
+            entries.push_back({key, offset});
+        }
+        if (entries.empty()) {
+            break;
+        }
+
+        radix_sort(entries, scratch);
+        if (at_end && runs.empty()) {
+            return write_run(output, buffer, entries);
+        }
+
+        file_type run{std::tmpfile()};
+        if (!run) [[unlikely]] {
+            return std::errc::io_error;
+        }
+        if (auto result = write_run(run.get(), buffer, entries);
+            failure(result)) [[unlikely]] {
+            return result;
+        }
+        // rewind() clears the error indicator, a failed write must be seen
+        // first or the merge would read a short run.
+        if (std::fflush(run.get()) || std::ferror(run.get())) [[unlikely]] {
+            return std::errc::io_error;
+        }
+        std::rewind(run.get());
+        runs.push_back(std::move(run));
+    }
+
+    struct run_head
+    {
+        record_reader<std::FILE *> reader;
+        std::vector<std::byte> record{};
+        std::size_t payload{};
+        std::uint64_t key{};
+    };
+    std::vector<run_head> heads;
+    heads.reserve(runs.size());
+    for (auto &run : runs) {
+        heads.push_back(run_head{record_reader<std::FILE *>{run.get()}});
+    }
+    auto later = [&](std::size_t left, std::size_t right) {
+        return std::tie(heads[left].key, left) >
+               std::tie(heads[right].key, right);
+    };
+    std::priority_queue<std::size_t, std::vector<std::size_t>,
+                        decltype(later)>
+        queue{later};
+
+    auto advance = [&](std::size_t index) -> bits::errc {
+        auto &head = heads[index];
+        head.record.clear();
+        bool at_end = false;
+        if (auto result = head.reader.read(head.record, head.payload, at_end);
+            failure(result)) [[unlikely]] {
+            return result;
+        }
+        if (at_end) {
             return {};
-        } else if constexpr (requires {
-                                 requires std::is_enum_v<typename type::value_type>;
-                             }) {
-            constexpr auto tag = make_tag<tag_type>(FieldNum);
+        }
+        if (auto result = record_sort_key<Type, Path...>(
+                std::span{head.record}.subspan(head.payload), head.key);
+            failure(result)) [[unlikely]] {
+            return result;
+        }
+        queue.push(index);
+        return {};
+    };
 
-            using type = typename type::value_type;
-            std::size_t size = {};
-            for (auto &element : item) {
-                size += bits::varint_size(std::underlying_type_t<type>(element));
+    for (std::size_t index = 0; index < runs.size(); ++index) {
+        if (auto result = advance(index); failure(result)) [[unlikely]] {
+            return result;
+        }
+    }
+    while (!queue.empty()) {
+        auto index = queue.top();
+        queue.pop();
+        auto &record = heads[index].record;
+        if (!write_bytes(output, record.data(), record.size())) [[unlikely]] {
+            return std::errc::io_error;
+        }
+        if (auto result = advance(index); failure(result)) [[unlikely]] {
+            return result;
+        }
+    }
+    return {};
+}
+
+// Returns a mask with bit i set when data[i] has the varint continuation
+// bit set, 64 bytes must be readable.
+ZPP_BITS_INLINE inline std::uint64_t continuation_mask(const std::byte *data)
+{
+#if defined __AVX2__
+    auto low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+    auto high =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 32));
+    return std::uint64_t(std::uint32_t(_mm256_movemask_epi8(low))) |
+           (std::uint64_t(std::uint32_t(_mm256_movemask_epi8(high))) << 32);
+#elif defined __SSE2__
+    std::uint64_t mask = 0;
+    for (std::size_t i = 0; i < 4; ++i) {
+        auto chunk =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i * 16));
+        mask |= std::uint64_t(std::uint16_t(_mm_movemask_epi8(chunk)))
+                << (i * 16);
+    }
+    return mask;
+#else
+    std::uint64_t mask = 0;
+    for (std::size_t i = 0; i < 8; ++i) {
+        std::uint64_t word = 0;
+        for (std::size_t j = 0; j < 8; ++j) {
+            word |= std::uint64_t(std::to_integer<unsigned>(data[i * 8 + j]))
+                    << (j * 8);
+        }
+        mask |= (((word & 0x8080808080808080) * 0x0002040810204081) >> 56)
+                << (i * 8);
+    }
+    return mask;
+#endif
+}
+
+// The location of a top level field in an encoded message.
+struct field_location
+{
+    std::uint32_t number;
+    wire_type type;
+    std::size_t offset;       // of the tag
+    std::size_t value_offset; // of the value, past the length prefix
+    std::size_t value_size;
+};
+
+// An index of the top level fields of an encoded message, built in one pass
+// that classifies varint terminators 64 bytes at a time (AVX2/SSE2 with a
+// SWAR fallback). The mask of a window serves every tag and length that
+// ends in it, varints of up to 8 bytes are decoded from a single word, and
+// length-delimited values are hopped over.
+class structural_index
+{
+public:
+    structural_index() = default;
+
+    explicit structural_index(auto &&view)
+    {
+        build(std::forward<decltype(view)>(view)).or_throw();
+    }
+
+    bits::errc build(auto &&view)
+    {
+        m_fields.clear();
+        return index(
+            reinterpret_cast<const std::byte *>(std::data(view)),
+            std::size(view) *
+                sizeof(std::remove_cvref_t<decltype(*std::data(view))>));
+    }
+
+    const std::vector<field_location> &fields() const
+    {
+        return m_fields;
+    }
+
+    std::size_t size() const
+    {
+        return m_fields.size();
+    }
+
+    // The last occurrence of the field, which is the one that is in effect
+    // for non repeated fields.
+    const field_location *find(std::uint32_t number) const
+    {
+        for (auto it = m_fields.rbegin(); it != m_fields.rend(); ++it) {
+            if (it->number == number) {
+                return &*it;
             }
-            if (!size) [[unlikely]] {
-                return {};
+        }
+        return nullptr;
+    }
+
+    auto find_all(std::uint32_t number) const
+    {
+        return m_fields | std::views::filter([number](auto &field) {
+                   return field.number == number;
+               });
+    }
+
+private:
+    bits::errc index(const std::byte *data, std::size_t size)
+    {
+        std::size_t position = 0;
+        std::size_t window = 0;
+        std::uint64_t mask = 0;
+        bool has_window = false;
+
+        auto read_varint = [&](std::uint64_t &value)
+                               ZPP_BITS_CONSTEXPR_INLINE_LAMBDA -> bits::errc {
+            constexpr auto max_size = bits::varint_max_size<std::uint64_t>;
+            std::size_t length;
+            if (size - position >= 64) [[likely]] {
+                auto offset = position - window;
+                std::uint64_t terminators =
+                    has_window && offset < 64 ? ~mask >> offset : 0;
+                if (!terminators) {
+                    window = position;
+                    mask = continuation_mask(data + window);
+                    has_window = true;
+                    terminators = ~mask;
+                }
+                length = std::countr_zero(terminators) + 1;
+                if (length > max_size) [[unlikely]] {
+                    return std::errc::value_too_large;
+                }
+                if constexpr (std::endian::native == std::endian::little) {
+                    if (length <= sizeof(std::uint64_t)) [[likely]] {
+                        value = decode_word(data + position, length);
+                        position += length;
+                        return {};
+                    }
+                }
+            } else {
+                length = 0;
+                auto limit = std::min(size - position, max_size);
+                while (length < limit &&
+                       std::to_integer<unsigned>(data[position + length]) >=
+                           0x80) {
+                    ++length;
+                }
+                if (length == limit) [[unlikely]] {
+                    return limit == max_size ? std::errc::value_too_large
+                                             : std::errc::result_out_of_range;
+                }
+                ++length;
             }
-            if (auto result = m_archive(tag, bits::varint{size}); failure(result))
-                [[unlikely]] {
+
+            value = 0;
+            for (std::size_t i = 0; i < length; ++i) {
+                value |= std::uint64_t(std::to_integer<unsigned>(
+                             data[position + i]) & 0x7f)
+                         << (i * (CHAR_BIT - 1));
+            }
+            position += length;
+            return {};
+        };
+
+        while (position < size) {
+            field_location field{};
+            field.offset = position;
+
+            std::uint64_t tag;
+            if (auto result = read_varint(tag); failure(result)) [[unlikely]] {
                 return result;
             }
-            for (auto &element : item) {
-                if (auto result =
-                        m_archive(bits::varint{std::underlying_type_t<type>(element)});
-                    failure(result)) [[unlikely]] {
-                    return result;
-                }
+            field.number = std::uint32_t(tag >> 3);
+            field.type = wire_type(tag & 0x7);
+            if (!field.number || (tag >> 3) > 0x1fffffff) [[unlikely]] {
+                return std::errc::protocol_error;
             }
-            return {};
-        } else {
-            constexpr auto tag = make_tag<typename type::value_type>(FieldNum);
-            for (auto &element : item) {
-                if (auto result = m_archive(tag); failure(result)) [[unlikely]] {
+
+            auto value_position = position;
+            switch (field.type) {
+            case wire_type::varint: {
+                std::uint64_t value;
+                if (auto result = read_varint(value); failure(result))
+                    [[unlikely]] {
                     return result;
                 }
-                if (auto result = serialize_sized(element); failure(result)) [[unlikely]] {
+                field.value_size = position - value_position;
+                break;
+            }
+            case wire_type::fixed_64:
+                field.value_size = sizeof(std::uint64_t);
+                break;
+            case wire_type::fixed_32:
+                field.value_size = sizeof(std::uint32_t);
+                break;
+            case wire_type::length_delimited: {
+                std::uint64_t length;
+                if (auto result = read_varint(length); failure(result))
+                    [[unlikely]] {
                     return result;
                 }
+                value_position = position;
+                field.value_size = length;
+                break;
             }
-            return {};
+            default:
+                return std::errc::protocol_error;
+            }
+
+            if (field.value_size > size - value_position) [[unlikely]] {
+                return std::errc::result_out_of_range;
+            }
+            field.value_offset = value_position;
+            position = value_position + field.value_size;
+            m_fields.push_back(field);
         }
+
+        return {};
     }
 
-    template <typename SizeType = bits::vsize_t>
-    constexpr bits::errc ZPP_BITS_INLINE serialize_sized(auto &&item)
+    // Decodes a varint of length bytes, at most 8, from a little endian
+    // word by packing its 7-bit groups in three steps.
+    ZPP_BITS_INLINE static std::uint64_t decode_word(const std::byte *data,
+                                                     std::size_t length)
     {
-        using type = std::remove_cvref_t<decltype(item)>;
+        std::uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        word &= ~std::uint64_t{} >> (64 - 8 * length);
+        word = ((word & 0x7f007f007f007f00) >> 1) |
+               (word & 0x007f007f007f007f);
+        word = ((word & 0x3fff00003fff0000) >> 2) |
+               (word & 0x00003fff00003fff);
+        return ((word & 0x0fffffff00000000) >> 4) |
+               (word & 0x000000000fffffff);
+    }
 
-        auto size_position = m_archive.position();
-        if (auto result = m_archive(SizeType{}); failure(result)) [[unlikely]] {
-            return result;
-        }
+    std::vector<field_location> m_fields;
+};
 
-        if (auto result = serialize_unsized(std::forward<decltype(item)>(item));
-            failure(result)) [[unlikely]] {
-            return result;
-        }
+// The sum, minimum, maximum and count of the elements of a numeric field,
+// see aggregate(). min and max are meaningful only when count is not 0.
+template <typename Type>
+struct field_stats
+{
+    using sum_type = std::conditional_t<
+        std::is_floating_point_v<Type>, double,
+        std::conditional_t<std::is_signed_v<Type>, std::int64_t,
+                           std::uint64_t>>;
 
-        auto current_position = m_archive.position();
-        std::size_t message_size =
-            current_position - size_position - sizeof(SizeType);
+    // std::byte has no numeric_limits, its range is that of unsigned char.
+    using limits = std::numeric_limits<std::conditional_t<
+        std::same_as<Type, std::byte>, unsigned char, Type>>;
 
-        if constexpr (bits::concepts::varint<SizeType>) {
-            constexpr auto preserialized_varint_size = 1;
-            message_size =
-                current_position - size_position - preserialized_varint_size;
-            auto move_ahead_count =
-                bits::varint_size(message_size) - preserialized_varint_size;
-            if (move_ahead_count) {
-                if constexpr (archive_type::resizable) {
-                    if (auto result = m_archive.enlarge_for(move_ahead_count);
-                        failure(result)) [[unlikely]] {
-                        return result;
-                    }
-                } else if (move_ahead_count >
-                           m_archive.data().size() - current_position) [[unlikely]] {
-                    return std::errc::result_out_of_range;
+    sum_type sum{};
+    Type min = Type(limits::has_infinity ? limits::infinity() : limits::max());
+    Type max =
+        Type(limits::has_infinity ? -limits::infinity() : limits::lowest());
+    std::size_t count = 0;
+
+    constexpr void add(Type value)
+    {
+        sum += sum_type(value);
+        min = std::min(min, value);
+        max = std::max(max, value);
+        ++count;
+    }
+
+    constexpr field_stats &operator+=(const field_stats &other)
+    {
+        sum += other.sum;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+        count += other.count;
+        return *this;
+    }
+};
+
+// The value type of a numeric member: the element of a repeated or bytes
+// member, the value of a varint.
+template <typename Type>
+constexpr auto aggregate_value()
+{
+    if constexpr (bits::concepts::container<Type>) {
+        return aggregate_value<typename Type::value_type>();
+    } else if constexpr (bits::concepts::varint<Type>) {
+        return std::type_identity<typename Type::value_type>{};
+    } else {
+        return std::type_identity<Type>{};
+    }
+}
+
+// The stats of the numeric field at the path of field numbers in Type.
+template <typename Type, auto... Path>
+using field_stats_t = field_stats<typename decltype(aggregate_value<
+    typename path_cursor<std::byte, Type, Path...>::member_type>())::type>;
+
+template <typename Type>
+ZPP_BITS_INLINE inline Type load_little(const std::byte *data)
+{
+    Type value;
+    if constexpr (std::endian::native == std::endian::little) {
+        std::memcpy(&value, data, sizeof(Type));
+    } else {
+        std::byte bytes[sizeof(Type)];
+        std::reverse_copy(data, data + sizeof(Type), bytes);
+        std::memcpy(&value, bytes, sizeof(Type));
+    }
+    return value;
+}
+
+// Folds packed fixed-width values into stats, double and float are reduced
+// a vector at a time with AVX2 or SSE2 and 32-bit integers with AVX2 only,
+// sums widened to the sum type, the rest element by element.
+template <typename Type>
+inline bits::errc aggregate_fixed(const std::byte *data, std::size_t size,
+                                  field_stats<Type> &stats)
+{
+    if (size % sizeof(Type)) [[unlikely]] {
+        return std::errc::protocol_error;
+    }
+    auto count = size / sizeof(Type);
+    std::size_t i = 0;
+
+    if constexpr (std::endian::native == std::endian::little) {
+#if defined __AVX2__
+        if constexpr (std::same_as<Type, double>) {
+            auto sum = _mm256_setzero_pd();
+            auto min = _mm256_set1_pd(stats.min);
+            auto max = _mm256_set1_pd(stats.max);
+            for (; i + 4 <= count; i += 4) {
+                auto values = _mm256_loadu_pd(
+                    reinterpret_cast<const double *>(data) + i);
+                sum = _mm256_add_pd(sum, values);
+                min = _mm256_min_pd(min, values);
+                max = _mm256_max_pd(max, values);
+            }
+            alignas(32) double lanes[3][4];
+            _mm256_store_pd(lanes[0], sum);
+            _mm256_store_pd(lanes[1], min);
+            _mm256_store_pd(lanes[2], max);
+            for (std::size_t lane = 0; lane < 4; ++lane) {
+                stats.sum += lanes[0][lane];
+                stats.min = std::min(stats.min, lanes[1][lane]);
+                stats.max = std::max(stats.max, lanes[2][lane]);
+            }
+        } else if constexpr (std::same_as<Type, float>) {
+            auto sum = _mm256_setzero_pd();
+            auto min = _mm256_set1_ps(stats.min);
+            auto max = _mm256_set1_ps(stats.max);
+            for (; i + 8 <= count; i += 8) {
+                auto values = _mm256_loadu_ps(
+                    reinterpret_cast<const float *>(data) + i);
+                sum = _mm256_add_pd(
+                    sum, _mm256_cvtps_pd(_mm256_castps256_ps128(values)));
+                sum = _mm256_add_pd(
+                    sum, _mm256_cvtps_pd(_mm256_extractf128_ps(values, 1)));
+                min = _mm256_min_ps(min, values);
+                max = _mm256_max_ps(max, values);
+            }
+            alignas(32) double sums[4];
+            alignas(32) float lanes[2][8];
+            _mm256_store_pd(sums, sum);
+            _mm256_store_ps(lanes[0], min);
+            _mm256_store_ps(lanes[1], max);
+            for (std::size_t lane = 0; lane < 8; ++lane) {
+                if (lane < 4) {
+                    stats.sum += sums[lane];
                 }
-                auto data = m_archive.data().data();
-                auto message_start = data + size_position + preserialized_varint_size;
-                auto message_end = data + current_position;
-                if (std::is_constant_evaluated()) {
-                    for (auto p = message_end - 1; p >= message_start; --p) {
-                        *(p + move_ahead_count) = *p;
-                    }
+                stats.min = std::min(stats.min, lanes[0][lane]);
+                stats.max = std::max(stats.max, lanes[1][lane]);
+            }
+        } else if constexpr (std::same_as<Type, std::int32_t> ||
+                             std::same_as<Type, std::uint32_t>) {
+            constexpr auto is_signed = std::is_signed_v<Type>;
+            auto sum = _mm256_setzero_si256();
+            auto min = _mm256_set1_epi32(std::int32_t(stats.min));
+            auto max = _mm256_set1_epi32(std::int32_t(stats.max));
+            for (; i + 8 <= count; i += 8) {
+                auto values = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i *>(data + i * 4));
+                auto low = _mm256_castsi256_si128(values);
+                auto high = _mm256_extracti128_si256(values, 1);
+                if constexpr (is_signed) {
+                    sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(low));
+                    sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(high));
+                    min = _mm256_min_epi32(min, values);
+                    max = _mm256_max_epi32(max, values);
                 } else {
-                    std::memmove(message_start + move_ahead_count, message_start,
-                                 message_size);
+                    sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(low));
+                    sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(high));
+                    min = _mm256_min_epu32(min, values);
+                    max = _mm256_max_epu32(max, values);
                 }
-                m_archive.position() += move_ahead_count;
             }
+            alignas(32) std::uint64_t sums[4];
+            alignas(32) Type lanes[2][8];
+            _mm256_store_si256(reinterpret_cast<__m256i *>(sums), sum);
+            _mm256_store_si256(reinterpret_cast<__m256i *>(lanes[0]), min);
+            _mm256_store_si256(reinterpret_cast<__m256i *>(lanes[1]), max);
+            for (std::size_t lane = 0; lane < 8; ++lane) {
+                if (lane < 4) {
+                    stats.sum += typename field_stats<Type>::sum_type(sums[lane]);
+                }
+                stats.min = std::min(stats.min, lanes[0][lane]);
+                stats.max = std::max(stats.max, lanes[1][lane]);
+            }
+        }
+#elif defined __SSE2__
+        if constexpr (std::same_as<Type, double>) {
+            auto sum = _mm_setzero_pd();
+            auto min = _mm_set1_pd(stats.min);
+            auto max = _mm_set1_pd(stats.max);
+            for (; i + 2 <= count; i += 2) {
+                auto values =
+                    _mm_loadu_pd(reinterpret_cast<const double *>(data) + i);
+                sum = _mm_add_pd(sum, values);
+                min = _mm_min_pd(min, values);
+                max = _mm_max_pd(max, values);
+            }
+            alignas(16) double lanes[3][2];
+            _mm_store_pd(lanes[0], sum);
+            _mm_store_pd(lanes[1], min);
+            _mm_store_pd(lanes[2], max);
+            for (std::size_t lane = 0; lane < 2; ++lane) {
+                stats.sum += lanes[0][lane];
+                stats.min = std::min(stats.min, lanes[1][lane]);
+                stats.max = std::max(stats.max, lanes[2][lane]);
+            }
+        } else if constexpr (std::same_as<Type, float>) {
+            auto sum = _mm_setzero_pd();
+            auto min = _mm_set1_ps(stats.min);
+            auto max = _mm_set1_ps(stats.max);
+            for (; i + 4 <= count; i += 4) {
+                auto values =
+                    _mm_loadu_ps(reinterpret_cast<const float *>(data) + i);
+                sum = _mm_add_pd(sum, _mm_cvtps_pd(values));
+                sum = _mm_add_pd(sum,
+                                 _mm_cvtps_pd(_mm_movehl_ps(values, values)));
+                min = _mm_min_ps(min, values);
+                max = _mm_max_ps(max, values);
+            }
+            alignas(16) double sums[2];
+            alignas(16) float lanes[2][4];
+            _mm_store_pd(sums, sum);
+            _mm_store_ps(lanes[0], min);
+            _mm_store_ps(lanes[1], max);
+            for (std::size_t lane = 0; lane < 4; ++lane) {
+                if (lane < 2) {
+                    stats.sum += sums[lane];
+                }
+                stats.min = std::min(stats.min, lanes[0][lane]);
+                stats.max = std::max(stats.max, lanes[1][lane]);
+            }
+        }
+#endif
+    }
+
+    stats.count += i;
+    for (; i < count; ++i) {
+        stats.add(load_little<Type>(data + i * sizeof(Type)));
+    }
+    return {};
+}
+
+// Decodes packed varints and folds them into stats in the same pass, with
+// no intermediate values. Terminators are found 64 bytes at a time with
+// continuation_mask(), a window without continuation bits holds 64 single
+// byte values which are folded directly.
+template <typename Type, bits::varint_encoding Encoding>
+inline bits::errc aggregate_varints(const std::byte *data, std::size_t size,
+                                    field_stats<Type> &stats)
+{
+    constexpr auto max_size = bits::varint_max_size<std::uint64_t>;
+    auto fold = [&](std::uint64_t value) ZPP_BITS_CONSTEXPR_INLINE_LAMBDA {
+        if constexpr (Encoding == bits::varint_encoding::zig_zag) {
+            value = (value >> 1) ^ (~(value & 1) + 1);
+        }
+        stats.add(Type(value));
+    };
+
+    std::size_t position = 0;
+    while (size - position >= 64) {
+        auto mask = continuation_mask(data + position);
+        if (!mask) {
+            for (std::size_t i = 0; i < 64; ++i) {
+                fold(std::to_integer<std::uint64_t>(data[position + i]));
+            }
+            position += 64;
+            continue;
+        }
+        auto window = position;
+        while (position - window <= 64 - max_size) {
+            auto length = std::size_t(std::countr_zero(
+                              ~(mask >> (position - window)))) + 1;
+            if (length > max_size) [[unlikely]] {
+                return std::errc::protocol_error;
+            }
+            std::uint64_t value = 0;
+            for (std::size_t i = 0; i < length; ++i) {
+                value |= std::uint64_t(std::to_integer<std::uint8_t>(
+                             data[position + i]) & 0x7f)
+                         << (7 * i);
+            }
+            fold(value);
+            position += length;
         }
+    }
 
-        auto message_length_span =
-            std::span<typename archive_type::byte_type, sizeof(SizeType)>{
-                m_archive.data().data() + size_position, sizeof(SizeType)};
-        auto message_length_out = bits::out<
-            std::span<typename archive_type::byte_type, sizeof(SizeType)>>{
-            message_length_span};
-        return message_length_out(SizeType(message_size));
+    while (position < size) {
+        std::uint64_t value = 0;
+        for (std::size_t shift = 0;; shift += 7) {
+            if (position == size) [[unlikely]] {
+                return std::errc::result_out_of_range;
+            }
+            if (shift >= 7 * max_size) [[unlikely]] {
+                return std::errc::protocol_error;
+            }
+            auto byte = std::to_integer<std::uint8_t>(data[position++]);
+            value |= std::uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+        fold(value);
     }
+    return {};
+}
 
-    template <typename SizeType = default_size_type>
-    constexpr bits::errc ZPP_BITS_INLINE serialize_one(auto &&item)
-    {
-        if constexpr (!std::is_void_v<SizeType>) {
-            return serialize_sized<SizeType>(std::forward<decltype(item)>(item));
+template <typename Element, typename Type>
+inline bits::errc aggregate_values(const std::byte *data, std::size_t size,
+                                   field_stats<Type> &stats)
+{
+    if constexpr (bits::concepts::varint<Element>) {
+        return aggregate_varints<Type, Element::encoding>(data, size, stats);
+    } else if constexpr (std::same_as<Element, bool>) {
+        return aggregate_varints<Type, bits::varint_encoding::normal>(
+            data, size, stats);
+    } else {
+        return aggregate_fixed(data, size, stats);
+    }
+}
+
+template <typename Type, auto FieldNumber, auto... Path>
+inline bits::errc aggregate_message(std::span<const std::byte> data,
+                                    auto &stats)
+{
+    using member_type = field_member_t<Type, FieldNumber>;
+    using element_type = std::conditional_t<
+        bits::concepts::container<member_type>,
+        typename member_type::value_type, member_type>;
+    static_assert(sizeof...(Path) != 0 ||
+                      !concepts::is_length_delimited<element_type>,
+                  "aggregate() needs a numeric field");
+    static_assert(!std::is_enum_v<element_type> ||
+                      std::same_as<element_type, std::byte>,
+                  "enums cannot be aggregated");
+
+    in input{data};
+    while (input.position() < data.size()) {
+        std::uint32_t number;
+        wire_type type;
+        if (auto result = input.read_tag(number, type); failure(result))
+            [[unlikely]] {
+            return result;
+        }
+        if (number != std::uint32_t(FieldNumber)) {
+            if (auto result = input.skip_field(type); failure(result))
+                [[unlikely]] {
+                return result;
+            }
+            continue;
+        }
+
+        auto position = input.position();
+        if (sizeof...(Path) != 0 || concepts::bytes_field<member_type> ||
+            type == wire_type::length_delimited) {
+            if (type != wire_type::length_delimited) [[unlikely]] {
+                return std::errc::protocol_error;
+            }
+            bits::vsize_t length;
+            if (auto result = input.read_length(length); failure(result))
+                [[unlikely]] {
+                return result;
+            }
+            if (length > data.size() - input.position()) [[unlikely]] {
+                return std::errc::result_out_of_range;
+            }
+            position = input.position();
+            input.position() += length;
+        } else if constexpr (!concepts::bytes_field<member_type>) {
+            if (type != tag_type<element_type>()) [[unlikely]] {
+                return std::errc::protocol_error;
+            }
+            if (auto result = input.skip_field(type); failure(result))
+                [[unlikely]] {
+                return result;
+            }
+        }
+
+        auto value = data.subspan(position, input.position() - position);
+        if constexpr (sizeof...(Path) != 0) {
+            if (auto result =
+                    aggregate_message<element_type, Path...>(value, stats);
+                failure(result)) [[unlikely]] {
+                return result;
+            }
         } else {
-            return serialize_unsized(std::forward<decltype(item)>(item));
+            if (auto result = aggregate_values<element_type>(
+                    value.data(), value.size(), stats);
+                failure(result)) [[unlikely]] {
+                return result;
+            }
         }
     }
-};
+    return {};
+}
 
-template <bits::concepts::byte_view ByteView, typename... Options>
-constexpr auto make_in_archive(ByteView &&view, Options &&...options)
+// Folds the numeric field at the given path of field numbers of the encoded
+// bytes of Type into stats, straight from the wire: packed fixed-width
+// payloads are reduced with SIMD and packed varints (zigzag included) are
+// decoded and reduced in one pass, nothing is materialized. Repeated fields
+// on the path contribute all their elements, and stats accumulate across
+// calls. Values that are not encoded (zero scalars) are not counted.
+template <typename Type, auto... Path>
+inline bits::errc aggregate(auto &&view, field_stats_t<Type, Path...> &stats)
 {
-    return bits::in{std::forward<ByteView>(view), bits::size_varint{},
-                    bits::endian::little{},
-                    bits::alloc_limit<bits::traits::alloc_limit<Options...>()>{}};
+    using byte_type = std::remove_cvref_t<decltype(*std::data(view))>;
+    return aggregate_message<Type, Path...>(
+        std::span{reinterpret_cast<const std::byte *>(std::data(view)),
+                  std::size(view) * sizeof(byte_type)},
+        stats);
 }
 
-template <bits::concepts::byte_view ByteView = std::vector<std::byte>,
-          typename... Options>
-class in {
-    using archive_type = decltype(make_in_archive(std::declval<ByteView &>(),
-                                                  std::declval<Options &&>()...));
-
-    archive_type m_archive;
+template <typename Type, auto... Path>
+inline bits::value_or_errc<field_stats_t<Type, Path...>> aggregate(auto &&view)
+{
+    field_stats_t<Type, Path...> stats;
+    if (auto result = aggregate<Type, Path...>(view, stats); failure(result))
+        [[unlikely]] {
+        return bits::value_or_errc<field_stats_t<Type, Path...>>{result};
+    }
+    return bits::value_or_errc<field_stats_t<Type, Path...>>{stats};
+}
 
+// A read-only view of an encoded message of Type. Construction scans the
+// tags once and records the first and last occurrence of every member,
+// accessors decode on demand: scalars by value, strings/bytes as views of
+// the input, sub-messages as nested views and repeated fields as forward
+// ranges. Nothing is allocated. Members are accessed by index (get) or by
+// field number (field), absent members yield their default value.
+template <typename Type, typename ByteType = std::byte>
+class view
+{
 public:
-    // using byte_type = std::add_const_t<typename ByteView::value_type>;
-
-    using default_size_type = traits::default_size_type_t<Options...>;
+    using byte_type = ByteType;
+    constexpr static std::size_t npos = std::numeric_limits<std::size_t>::max();
+    constexpr static std::size_t member_count = bits::number_of_members<Type>();
 
-    constexpr explicit in(ByteView &&view, Options &&...options) :
-        m_archive(make_in_archive(std::move(view),
-                                  std::forward<Options>(options)...))
-    {}
+    constexpr view()
+    {
+        m_first.fill(npos);
+        m_last.fill(npos);
+    }
 
-    constexpr explicit in(ByteView &view, Options &&...options) :
-        m_archive(make_in_archive(view, std::forward<Options>(options)...))
-    {}
+    constexpr explicit view(std::span<const ByteType> data) : m_data(data)
+    {
+        m_first.fill(npos);
+        m_last.fill(npos);
+        m_error = scan();
+    }
 
-    ZPP_BITS_INLINE constexpr bits::errc
-    operator()(auto &item)
+    constexpr explicit view(auto &&data) requires(
+        !std::same_as<std::remove_cvref_t<decltype(data)>, view> &&
+        !std::same_as<std::remove_cvref_t<decltype(data)>,
+                      std::span<const ByteType>>) :
+        view(std::span<const ByteType>{std::data(data), std::size(data)})
     {
-        return serialize_one(item);
     }
 
-    constexpr std::size_t position() const
+    constexpr bits::errc error() const
     {
-        return m_archive.position();
+        return m_error;
     }
 
+    constexpr std::span<const ByteType> data() const
+    {
+        return m_data;
+    }
 
-    constexpr std::size_t &position()
+    template <std::size_t Index>
+    constexpr bool has() const
     {
-        return m_archive.position();
+        return m_last[Index] != npos;
     }
 
-    constexpr auto remaining_data()
+    template <std::size_t Index>
+    constexpr auto get() const
     {
-        return m_archive.remaining_data();
+        using member_type = typename decltype(
+            unwrap_optional<member_type_t<Type, Index>>())::type;
+        using cursor_type =
+            path_cursor<ByteType, Type, field_num<Type, Index>()>;
+        using value_type = typename cursor_type::value_type;
+
+        if constexpr (concepts::repeated_field<member_type>) {
+            auto data = has<Index>() ? m_data.subspan(m_first[Index])
+                                     : std::span<const ByteType>{};
+            if constexpr (!concepts::bytes_field<
+                              field_element_t<member_type>> &&
+                          std::same_as<value_type, std::span<const ByteType>>) {
+                using element_type = std::conditional_t<
+                    bits::concepts::associative_container<member_type> &&
+                        requires { typename member_type::mapped_type; },
+                    map_entry<member_type>,
+                    field_element_t<member_type>>;
+                return path_range<cursor_type, make_view<element_type>>{
+                    cursor_type{data}};
+            } else {
+                return path_range<cursor_type>{cursor_type{data}};
+            }
+        } else {
+            value_type value{};
+            if (has<Index>()) {
+                cursor_type cursor{m_data.subspan(m_last[Index])};
+                if (cursor.next()) {
+                    value = cursor.current();
+                }
+            }
+            if constexpr (!concepts::bytes_field<member_type> &&
+                          std::same_as<value_type, std::span<const ByteType>>) {
+                return view<member_type, ByteType>{value};
+            } else {
+                return value;
+            }
+        }
     }
 
-    constexpr static auto kind()
+    template <auto FieldNumber>
+    constexpr auto field() const
     {
-        return bits::kind::in;
+        return get<member_index<Type, FieldNumber>()>();
     }
 
-    ZPP_BITS_INLINE constexpr bits::errc deserialize_fields(auto &item, std::size_t end_position)
+private:
+    template <typename Element>
+    struct make_view
     {
-        using type = std::remove_cvref_t<decltype(item)>;
-        static_assert(check_type<type>());
+        constexpr auto operator()(std::span<const ByteType> data) const
+        {
+            return view<Element, ByteType>{data};
+        }
+    };
 
-        bits::visit_members(item, [](auto &...members) ZPP_BITS_CONSTEXPR_INLINE_LAMBDA {
-            (
-                [](auto &member) ZPP_BITS_CONSTEXPR_INLINE_LAMBDA {
-                    using type = std::remove_cvref_t<decltype(member)>;
-                    if constexpr (bits::concepts::container<type> &&
-                                  !std::is_fundamental_v<type> &&
-                                  !std::same_as<type, std::byte> &&
-                                  requires { member.clear(); }) {
-                        member.clear();
-                    } else if constexpr (bits::concepts::optional<type> || bits::concepts::owning_pointer<type>) {
-                        member.reset();
-                    } else if constexpr (std::is_fundamental_v<type>) {
-                        member = 0;
-                    } else if constexpr (bits::concepts::varint<type>) {
-                        member = static_cast<typename type::value_type>(0);
-                    }
-                }(members),
-                ...);
-        });
+    constexpr static std::size_t member_of(std::uint32_t number)
+    {
+        constexpr auto numbers = field_numbers(static_cast<Type *>(nullptr));
+        for (std::size_t i = 0; i < numbers.size(); ++i) {
+            if (std::uint32_t(numbers[i]) == number) {
+                return i;
+            }
+        }
+        return npos;
+    }
 
-        while (m_archive.position() < end_position) {
-            bits::vuint32_t tag;
-            if (auto result = m_archive(tag); failure(result)) [[unlikely]] {
+    constexpr bits::errc scan()
+    {
+        in<std::span<const ByteType>> input{std::span{m_data}};
+        while (input.position() < m_data.size()) {
+            auto offset = input.position();
+            std::uint32_t number;
+            wire_type type;
+            if (auto result = input.read_tag(number, type); failure(result))
+                [[unlikely]] {
                 return result;
             }
-
-            if (auto result =
-                    deserialize_field(item, tag_number(tag), proto::tag_type(tag));
-                failure(result)) [[unlikely]] {
+            if (auto index = member_of(number); index != npos) {
+                if (m_first[index] == npos) {
+                    m_first[index] = offset;
+                }
+                m_last[index] = offset;
+            }
+            if (auto result = input.skip_field(type); failure(result))
+                [[unlikely]] {
                 return result;
             }
         }
-
         return {};
     }
 
-    template <std::size_t Index = 0>
-    ZPP_BITS_INLINE constexpr auto
-    deserialize_field(auto &&item, auto field_num,
-                      wire_type field_type)
-    {
-        using type = std::remove_reference_t<decltype(item)>;
-        if constexpr (Index >= bits::number_of_members<type>()) {
-            // unknown field, we should skip it
-            return bits::errc{};
-        } else if (proto::field_num<type, Index>() != field_num) {
-            return deserialize_field<Index + 1>(item, field_num, field_type);
-        } else if constexpr (bits::concepts::self_referencing<type>) {
-            return bits::visit_members(
-                item, [&](auto &&...items) constexpr {
-                    std::tuple<decltype(items) &...> refs = {items...};
-                    auto &item = std::get<Index>(refs);
-                    using type = std::remove_reference_t<decltype(item)>;
-                    static_assert(check_type<type>());
-                    return deserialize_field(field_type, item);
-                });
-        } else {
-            return bits::visit_members(
-                item, [&](auto &&...items) ZPP_BITS_CONSTEXPR_INLINE_LAMBDA {
-                    std::tuple<decltype(items) &...> refs = {items...};
-                    auto &item = std::get<Index>(refs);
-                    using type = std::remove_reference_t<decltype(item)>;
-                    static_assert(check_type<type>());
+    std::span<const ByteType> m_data{};
+    std::array<std::size_t, member_count> m_first;
+    std::array<std::size_t, member_count> m_last;
+    bits::errc m_error{};
+};
 
-                    return deserialize_field(field_type, item);
-                });
-        }
+// Decodes item from the input like in{view}(item), the elements of the
+// repeated message field FieldNumber are located first and then decoded
+// across threads into preallocated slots of the destination, preserving
+// order. Inputs below the threshold of the parallel<> option (defaulted
+// when not given) are decoded serially. A field_mask option applies to
+// item, and its sub-mask of FieldNumber to the elements.
+template <auto FieldNumber, typename Type, typename... Options>
+bits::errc deserialize_parallel(auto &&view, Type &item, Options... options)
+{
+    constexpr auto index = member_index<Type, FieldNumber>();
+    using member_type = member_type_t<Type, index>;
+    using element_type = field_element_t<member_type>;
+    static_assert(concepts::repeated_field<member_type> &&
+                      !bits::concepts::associative_container<member_type> &&
+                      std::is_class_v<element_type> &&
+                      !concepts::bytes_field<element_type>,
+                  "FieldNumber must be a repeated message field");
+    static_assert(!(... || std::same_as<std::remove_cvref_t<Options>, intern>),
+                  "a string_pool cannot be shared between threads");
+    using parallel_type =
+        std::conditional_t<std::is_void_v<traits::parallel_t<Options...>>,
+                           parallel<>,
+                           traits::parallel_t<Options...>>;
+    using byte_type = std::remove_cvref_t<decltype(*std::data(view))>;
+    using mask_type = traits::field_mask_t<Options...>;
+
+    std::span<const byte_type> data{std::data(view), std::size(view)};
+    if (data.size() < parallel_type::parallel_threshold ||
+        !mask_selects<mask_type, Type, index>()) {
+        return in<std::span<const byte_type>, Options...>{
+            data, Options{options}...}(item);
     }
 
-    ZPP_BITS_INLINE constexpr auto
-    deserialize_field(wire_type field_type, auto &item)
-    {
-        using type = std::remove_reference_t<decltype(item)>;
-        static_assert(check_type<type>());
+    std::vector<std::span<const byte_type>> elements;
+    path_cursor<byte_type, Type, FieldNumber> cursor{data};
+    while (cursor.next()) {
+        elements.push_back(cursor.current());
+    }
+    if (failure(cursor.error())) [[unlikely]] {
+        return cursor.error();
+    }
 
-        if constexpr (std::is_enum_v<type>) {
-            bits::varint<type> value;
-            if (auto result = m_archive(value); failure(result)) [[unlikely]] {
-                return result;
+    in<std::span<const byte_type>,
+       use_field_mask<without_field<mask_type, FieldNumber>>, Options...>
+        input{data, {}, Options{options}...};
+    if (auto result = input(item); failure(result)) [[unlikely]] {
+        return result;
+    }
+
+    auto &values = bits::visit_members(
+        item, [](auto &...members) -> auto & {
+            return std::get<index>(std::tie(members...));
+        });
+    values.clear();
+    values.resize(elements.size());
+
+    return parallel_type::run(
+        elements.size(), [&](std::size_t begin, std::size_t end) {
+            for (auto i = begin; i < end; ++i) {
+                in<std::span<const byte_type>,
+                   use_field_mask<sub_mask_t<mask_type, Type, index>>,
+                   Options...>
+                    element{elements[i], {}, Options{options}...};
+                if (auto result = element(values[i]); failure(result))
+                    [[unlikely]] {
+                    return result;
+                }
             }
-            item = value;
             return bits::errc{};
-        } else if constexpr (!concepts::is_length_delimited<type>) {
-            return m_archive(item);
-        } else if constexpr (requires { type::serialize(*this, item); }) {
-            return type::serialize(*this, item);
-        } else if constexpr (requires { serialize(*this, item); }) {
-            return serialize(*this, item);
-        } else if constexpr (bits::concepts::optional<type>) {
-            return deserialize_field(field_type, item.emplace());
-        } else if constexpr (!bits::concepts::container<type>) {
-            return serialize_one<bits::varint<uint32_t>>(item);
-        } else if constexpr (bits::concepts::associative_container<type> &&
-                             requires { typename type::mapped_type; }) {
-            using key_type = std::conditional_t<
-                std::is_enum_v<typename type::key_type> &&
-                    !std::same_as<typename type::key_type, std::byte>,
-                bits::varint<typename type::key_type>, typename type::key_type>;
-
-            using mapped_type = std::conditional_t<
-                std::is_enum_v<typename type::mapped_type> &&
-                    !std::same_as<typename type::mapped_type, std::byte>,
-                bits::varint<typename type::mapped_type>, typename type::mapped_type>;
-
-            struct value_type
-            {
-                key_type key;
-                mapped_type value;
-            };
+        });
+}
+
+namespace concepts
+{
+template <typename Type>
+concept patchable_field = !concepts::is_length_delimited<Type> ||
+    (std::is_enum_v<Type> && !std::same_as<Type, std::byte>);
+} // namespace concepts
 
-            std::aligned_storage_t<sizeof(value_type), alignof(value_type)> storage;
+template <typename Type, auto FieldNumber>
+using patch_member_t = typename decltype(unwrap_optional<
+    member_type_t<Type, member_index<Type, FieldNumber>()>>())::type;
 
-            auto object = bits::access::placement_new<value_type>(std::addressof(storage));
-            bits::destructor_guard guard{*object};
-            if (auto result = serialize_one<bits::varint<uint32_t>>(*object);
-                failure(result)) [[unlikely]] {
-                return result;
+// The offset of the value of the last occurrence of the fixed-width or
+// varint field FieldNumber in the encoded bytes of Type, found by a scan
+// of the top level tags.
+template <typename Type, auto FieldNumber>
+constexpr bits::value_or_errc<std::size_t> field_offset(auto &&view)
+{
+    using member_type = patch_member_t<Type, FieldNumber>;
+    static_assert(concepts::patchable_field<member_type>,
+                  "only fixed-width and varint fields can be patched");
+    using byte_type = std::remove_cvref_t<decltype(*std::data(view))>;
+
+    in input{std::span<const byte_type>{std::data(view), std::size(view)}};
+    std::optional<std::size_t> offset;
+    while (input.position() < std::size(view)) {
+        std::uint32_t number;
+        wire_type type;
+        if (auto result = input.read_tag(number, type); failure(result))
+            [[unlikely]] {
+            return bits::value_or_errc<std::size_t>{result};
+        }
+        if (number == std::uint32_t(FieldNumber)) {
+            if (type != tag_type<member_type>()) [[unlikely]] {
+                return bits::value_or_errc<std::size_t>{
+                    bits::errc{std::errc::protocol_error}};
+            }
+            offset = input.position();
+        }
+        if (auto result = input.skip_field(type); failure(result))
+            [[unlikely]] {
+            return bits::value_or_errc<std::size_t>{result};
+        }
+    }
+
+    if (!offset) {
+        return bits::value_or_errc<std::size_t>{
+            bits::errc{std::errc::no_message}};
+    }
+    return bits::value_or_errc<std::size_t>{*offset};
+}
+
+// Overwrites the value of field FieldNumber at a known value offset (from
+// field_offset() or structural_index), a varint value must have the same
+// encoded length as the one it replaces.
+template <typename Type, auto FieldNumber>
+constexpr bits::errc patch_at(auto &&view, std::size_t offset, auto value)
+{
+    using member_type = patch_member_t<Type, FieldNumber>;
+    static_assert(concepts::patchable_field<member_type>,
+                  "only fixed-width and varint fields can be patched");
+
+    auto data = std::data(view);
+    auto size = std::size(view);
+    if (offset > size) [[unlikely]] {
+        return std::errc::result_out_of_range;
+    }
+
+    std::size_t length = 0;
+    if constexpr (tag_type<member_type>() == wire_type::varint) {
+        constexpr auto max_size = bits::varint_max_size<std::uint64_t>;
+        while (true) {
+            if (length == max_size) [[unlikely]] {
+                return std::errc::value_too_large;
+            }
+            if (offset + length == size) [[unlikely]] {
+                return std::errc::result_out_of_range;
+            }
+            if (!(std::uint8_t(data[offset + length++]) & 0x80)) {
+                break;
             }
+        }
+    } else {
+        length = sizeof(member_type);
+        if (length > size - offset) [[unlikely]] {
+            return std::errc::result_out_of_range;
+        }
+    }
 
-            item.emplace(std::move(object->key), std::move(object->value));
-            return bits::errc{};
-        } else {
-            using orig_value_type = typename type::value_type;
-            using value_type =
-                std::conditional_t<std::is_enum_v<orig_value_type> &&
-                                       !std::same_as<orig_value_type, std::byte>,
-                                   bits::varint<orig_value_type>, orig_value_type>;
+    auto encode = [&](auto encoded) {
+        using encoded_type = decltype(encoded);
+        if constexpr (bits::concepts::varint<encoded_type>) {
+            if (bits::varint_size<encoded_type::encoding>(encoded.value) !=
+                length) [[unlikely]] {
+                return bits::errc{std::errc::value_too_large};
+            }
+        }
+        return bits::out{std::span{data + offset, length},
+                         bits::endian::little{}}(encoded);
+    };
 
-            if constexpr (!concepts::is_length_delimited<value_type>) {
-                auto fetch = [&]() ZPP_BITS_CONSTEXPR_INLINE_LAMBDA {
-                    value_type value;
-                    if (auto result = m_archive(value); failure(result)) [[unlikely]] {
-                        return result;
-                    }
+    if constexpr (std::is_enum_v<member_type>) {
+        return encode(bits::varint{std::underlying_type_t<member_type>(
+            member_type(value))});
+    } else if constexpr (std::same_as<member_type, bool>) {
+        if (length != 1) [[unlikely]] {
+            return std::errc::value_too_large;
+        }
+        data[offset] = std::remove_cvref_t<decltype(*data)>(value ? 1 : 0);
+        return {};
+    } else {
+        return encode(member_type(value));
+    }
+}
 
-                    if constexpr (requires { item.push_back(orig_value_type(value)); }) {
-                        item.push_back(orig_value_type(value));
-                    } else {
-                        item.insert(orig_value_type(value));
-                    }
+// Finds field FieldNumber with field_offset() and overwrites its value in
+// place, see patch_at().
+template <typename Type, auto FieldNumber>
+constexpr bits::errc patch(auto &&view, auto value)
+{
+    auto offset = field_offset<Type, FieldNumber>(view);
+    if (failure(offset)) [[unlikely]] {
+        return offset.error();
+    }
+    return patch_at<Type, FieldNumber>(view, offset.value(), value);
+}
 
-                    return bits::errc{};
-                };
-                if (field_type != wire_type::length_delimited) [[unlikely]] {
-                    return fetch();
-                }
-                bits::vsize_t length;
-                if (auto result = m_archive(length); failure(result)) [[unlikely]] {
-                    return result;
-                }
+// Patches field FieldNumber in every buffer, values is either a single
+// value of the member type or a range holding the value of each buffer,
+// a range shorter than buffers is an invalid_argument. Stops at the first
+// buffer that fails and returns its error.
+template <typename Type, auto FieldNumber>
+constexpr bits::errc patch_batch(auto &&buffers, const auto &values)
+{
+    using values_type = std::remove_cvref_t<decltype(values)>;
+    constexpr auto single =
+        std::convertible_to<const values_type &,
+                            patch_member_t<Type, FieldNumber>>;
+    static_assert(single || std::ranges::random_access_range<values_type>,
+                  "values must be a member value or a range of them");
+
+    if constexpr (!single && std::ranges::sized_range<decltype(buffers)>) {
+        if (std::ranges::size(values) < std::ranges::size(buffers))
+            [[unlikely]] {
+            return std::errc::invalid_argument;
+        }
+    }
+
+    std::size_t index = 0;
+    for (auto &&buffer : buffers) {
+        bits::errc result;
+        if constexpr (single) {
+            result = patch<Type, FieldNumber>(buffer, values);
+        } else {
+            if (index >= std::size_t(std::ranges::size(values))) [[unlikely]] {
+                return std::errc::invalid_argument;
+            }
+            result = patch<Type, FieldNumber>(buffer, values[index]);
+        }
+        if (failure(result)) [[unlikely]] {
+            return result;
+        }
+        ++index;
+    }
+    return {};
+}
 
-                if constexpr (requires { item.resize(1); } &&
-                              ( std::is_fundamental_v<value_type> ||
-                                std::same_as<value_type, std::byte> ) ) {
-                    if constexpr (archive_type::allocation_limit !=
-                                  std::numeric_limits<std::size_t>::max()) {
-                        if (length > archive_type::allocation_limit) [[unlikely]] {
-                            return bits::errc{std::errc::message_size};
-                        }
-                    }
-                    item.resize(length / sizeof(value_type));
-                    return m_archive(bits::unsized(item));
-                } else {
-                    if constexpr (requires { item.reserve(1); }) {
-                        item.reserve(length);
-                    }
+// A message baked at compile time from Object, except for the fixed-width
+// top level fields listed in Holes whose values are stored at runtime.
+// The holes are encoded with a non-zero placeholder so that they are
+// always present, producing a message is then a copy of bytes and a store
+// per hole.
+template <auto Object, auto... Holes>
+class message_template
+{
+public:
+    using type = std::remove_cv_t<decltype(Object)>;
+    static_assert(
+        (... && (concepts::patchable_field<patch_member_t<type, Holes>> &&
+                 tag_type<patch_member_t<type, Holes>>() !=
+                     wire_type::varint)),
+        "holes must be fixed-width fields");
 
-                    auto end_position = length + m_archive.position();
-                    while (m_archive.position() < end_position) {
-                        if (auto result = fetch(); failure(result)) [[unlikely]] {
-                            return result;
-                        }
+private:
+    constexpr static auto with_holes()
+    {
+        auto object = Object;
+        bits::visit_members(object, [](auto &...members) constexpr {
+            [&]<std::size_t... Indices>(std::index_sequence<Indices...>) {
+                auto mark = [&]<std::size_t Index>(auto &member) {
+                    if constexpr ((... ||
+                                   (std::uint32_t(field_num<type, Index>()) ==
+                                    std::uint32_t(Holes)))) {
+                        member = 1;
                     }
+                };
+                (mark.template operator()<Indices>(members), ...);
+            }(std::make_index_sequence<sizeof...(members)>{});
+        });
+        return object;
+    }
 
-                    return bits::errc{};
-                }
-            } else {
-                std::aligned_storage_t<sizeof(value_type), alignof(value_type)> storage;
-
-                auto object =
-                    bits::access::placement_new<value_type>(std::addressof(storage));
-                bits::destructor_guard guard{*object};
-                if (auto result = serialize_one< bits::varint<uint32_t>>(*object);
-                    failure(result)) [[unlikely]] {
-                    return result;
-                }
+    template <typename Value>
+    constexpr static void store(std::byte *data, const Value &value)
+    {
+        bits::out{std::span{data, sizeof(Value)}, bits::endian::little{}}(
+            value)
+            .or_throw();
+    }
 
-                if constexpr (requires { item.push_back(std::move(*object)); }) {
-                    item.push_back(std::move(*object));
-                } else {
-                    item.insert(std::move(*object));
-                }
+public:
+    constexpr static auto bytes = to_bytes<with_holes()>();
+    constexpr static std::size_t size = bytes.size();
+    constexpr static std::array<std::size_t, sizeof...(Holes)> offsets{
+        {field_offset<type, Holes>(bytes).value()...}};
 
-                return bits::errc{};
-            }
+    // Writes the message to data (at least size bytes) with the values of
+    // the holes, in the order of Holes.
+    constexpr static void write(std::byte *data,
+                                const patch_member_t<type, Holes> &...values)
+    {
+        if (std::is_constant_evaluated()) {
+            std::copy(bytes.begin(), bytes.end(), data);
+        } else {
+            std::memcpy(data, bytes.data(), size);
         }
+        [&]<std::size_t... Indices>(std::index_sequence<Indices...>) {
+            (store(data + offsets[Indices], values), ...);
+        }(std::make_index_sequence<sizeof...(Holes)>{});
     }
 
-    template <typename SizeType = default_size_type>
-    ZPP_BITS_INLINE constexpr bits::errc serialize_one(auto &item)
+    constexpr static std::array<std::byte, size>
+    make(const patch_member_t<type, Holes> &...values)
     {
-        // using type = std::remove_cvref_t<decltype(item)>;
-        if constexpr (!std::is_void_v<SizeType>) {
-            SizeType size{};
-            if (auto result = m_archive(size); failure(result)) [[unlikely]] {
+        std::array<std::byte, size> data;
+        write(data.data(), values...);
+        return data;
+    }
+};
+
+// Replaces the last occurrence of the field at the given path of field
+// numbers in the encoded bytes of Type, held in a resizable buffer, with
+// the encoding of value, then fixes up the length prefix of every
+// enclosing sub-message from the inside out, moving the tail once per
+// level. A missing field is appended to its parent, the sub-messages on
+// the way must be present.
+template <typename Type, auto... Path>
+bits::errc splice(
+    auto &buffer,
+    const typename path_cursor<std::byte, Type, Path...>::member_type &value)
+{
+    using cursor_type = path_cursor<std::byte, Type, Path...>;
+    static_assert(!cursor_type::repeated,
+                  "repeated fields cannot be spliced");
+    constexpr auto depth = cursor_type::depth;
+    using byte_type = std::remove_cvref_t<decltype(*std::data(buffer))>;
+
+    struct length_prefix
+    {
+        std::size_t offset;
+        std::size_t size;
+        std::size_t length;
+    };
+    std::array<length_prefix, depth - 1> prefixes{};
+
+    std::size_t begin = 0;
+    std::size_t end = buffer.size();
+    std::size_t field_begin = end;
+    std::size_t field_end = end;
+    for (std::size_t level = 0; level < depth; ++level) {
+        in input{std::span<const byte_type>{buffer.data(), end}};
+        input.position() = begin;
+
+        std::optional<length_prefix> found;
+        while (input.position() < end) {
+            auto offset = input.position();
+            std::uint32_t number;
+            wire_type type;
+            if (auto result = input.read_tag(number, type); failure(result))
+                [[unlikely]] {
                 return result;
             }
-            if (size > m_archive.remaining_data().size()) [[unlikely]]
-                return bits::errc{std::errc::message_size};
+            auto prefix_offset = input.position();
+            if (auto result = input.skip_field(type); failure(result))
+                [[unlikely]] {
+                return result;
+            }
+            if (number != cursor_type::path[level]) {
+                continue;
+            }
+            if (level == depth - 1) {
+                field_begin = offset;
+                field_end = input.position();
+                continue;
+            }
+            if (type != wire_type::length_delimited) [[unlikely]] {
+                return std::errc::protocol_error;
+            }
+            auto value_end = input.position();
+            input.position() = prefix_offset;
+            bits::vsize_t length;
+            if (auto result = input.read_length(length); failure(result))
+                [[unlikely]] {
+                return result;
+            }
+            found = length_prefix{prefix_offset,
+                                  input.position() - prefix_offset,
+                                  length};
+            input.position() = value_end;
+        }
 
-            return deserialize_fields(item, m_archive.position() + size);
-        } else
-            return deserialize_fields(item, m_archive.data().size());
+        if (level != depth - 1) {
+            if (!found) [[unlikely]] {
+                return std::errc::no_message;
+            }
+            prefixes[level] = *found;
+            begin = found->offset + found->size;
+            end = begin + found->length;
+            field_begin = field_end = end;
+        }
     }
-};
-template <typename Type, std::size_t Size, typename... Options>
-in(Type (&)[Size], Options &&...) -> in<std::span<Type, Size>, Options...>;
 
-template <typename Type, typename SizeType, typename... Options>
-in(bits::sized_item<Type, SizeType> &, Options &&...)
-    -> in<Type, Options...>;
+    auto replace = [&](std::size_t offset, std::size_t size,
+                       std::span<const byte_type> bytes) {
+        auto old_size = buffer.size();
+        if (bytes.size() > size) {
+            buffer.resize(old_size + bytes.size() - size);
+        }
+        auto data = buffer.data();
+        std::memmove(data + offset + bytes.size(), data + offset + size,
+                     old_size - offset - size);
+        std::memcpy(data + offset, bytes.data(), bytes.size());
+        if (bytes.size() < size) {
+            buffer.resize(old_size - (size - bytes.size()));
+        }
+        return std::ptrdiff_t(bytes.size()) - std::ptrdiff_t(size);
+    };
 
-template <typename Type, typename SizeType, typename... Options>
-in(const bits::sized_item<Type, SizeType> &, Options &&...)
-    -> in<const Type, Options...>;
+    std::vector<byte_type> field;
+    out output{field};
+    if (auto result =
+            output.template serialize_field<cursor_type::path[depth - 1]>(
+                value);
+        failure(result)) [[unlikely]] {
+        return result;
+    }
+    auto delta = replace(field_begin, field_end - field_begin,
+                         std::span{field.data(), output.position()});
 
-template <typename Type, typename SizeType, typename... Options>
-in(bits::sized_item<Type, SizeType> &&, Options &&...)
-    -> in<Type, Options...>;
+    for (auto level = depth - 1; level-- > 0;) {
+        auto &prefix = prefixes[level];
+        std::array<byte_type, bits::varint_max_size<std::uint64_t>> length;
+        bits::out length_out{length};
+        if (auto result = length_out(
+                bits::varint{std::size_t(std::ptrdiff_t(prefix.length) + delta)});
+            failure(result)) [[unlikely]] {
+            return result;
+        }
+        delta += replace(prefix.offset, prefix.size,
+                         std::span{length.data(), length_out.position()});
+    }
+    return {};
+}
 
-constexpr auto input(auto &&view, auto &&...option)
+// What parse_events() does after a field event.
+enum class event_action
 {
-    return in(std::forward<decltype(view)>(view),
-              std::forward<decltype(option)>(option)...);
-}
+    next,  // continue with the next field, sub-messages are skipped
+    enter, // parse the length-delimited value as a sub-message
+    stop,  // stop parsing successfully
+};
 
-constexpr auto output(auto &&view, auto &&...option)
+// A field reported by parse_events(), varint and fixed-width values are in
+// value (undecoded zig-zag, fixed-width bits), length-delimited values in
+// bytes as a view of the input.
+template <typename ByteType>
+struct field_event
 {
-    return out(std::forward<decltype(view)>(view),
-               std::forward<decltype(option)>(option)...);
+    std::uint32_t number{};
+    wire_type type{};
+    std::uint64_t value{};
+    std::span<const ByteType> bytes{};
+    std::size_t depth{};
+
+    // The value as the given scalar type, a zig-zag varint type such as
+    // vsint32_t is decoded.
+    template <typename Type>
+    constexpr Type as() const
+    {
+        if constexpr (bits::concepts::varint<Type>) {
+            using value_type = typename Type::value_type;
+            if constexpr (Type::encoding == bits::varint_encoding::zig_zag) {
+                return Type{value_type((value >> 1) ^ (~(value & 1) + 1))};
+            } else {
+                return Type{value_type(value)};
+            }
+        } else if constexpr (std::is_floating_point_v<Type>) {
+            if constexpr (sizeof(Type) == sizeof(std::uint32_t)) {
+                return std::bit_cast<Type>(std::uint32_t(value));
+            } else {
+                return std::bit_cast<Type>(value);
+            }
+        } else {
+            return Type(value);
+        }
+    }
+};
+
+namespace detail
+{
+template <typename ByteType>
+constexpr bits::errc parse_events(in<std::span<const ByteType>> &input,
+                                  std::size_t end,
+                                  std::size_t depth,
+                                  auto &handler,
+                                  bool &stopped)
+{
+    constexpr std::size_t max_depth = 100;
+    if (depth > max_depth) [[unlikely]] {
+        return std::errc::protocol_error;
+    }
+
+    while (input.position() < end) {
+        field_event<ByteType> event{.depth = depth};
+        if (auto result = input.read_tag(event.number, event.type);
+            failure(result)) [[unlikely]] {
+            return result;
+        }
+
+        bits::errc result{};
+        switch (event.type) {
+        case wire_type::varint: {
+            bits::vuint64_t value;
+            result = input.read_scalar(value);
+            event.value = value;
+            break;
+        }
+        case wire_type::fixed_64: {
+            std::uint64_t value{};
+            result = input.read_scalar(value);
+            event.value = value;
+            break;
+        }
+        case wire_type::fixed_32: {
+            std::uint32_t value{};
+            result = input.read_scalar(value);
+            event.value = value;
+            break;
+        }
+        case wire_type::length_delimited: {
+            bits::vsize_t length;
+            result = input.read_length(length);
+            if (success(result)) {
+                if (length > input.remaining_data().size()) [[unlikely]] {
+                    return std::errc::message_size;
+                }
+                event.bytes = input.remaining_data().first(length);
+            }
+            break;
+        }
+        default:
+            return std::errc::protocol_error;
+        }
+        if (failure(result)) [[unlikely]] {
+            return result;
+        }
+        if (input.position() + event.bytes.size() > end) [[unlikely]] {
+            return std::errc::result_out_of_range;
+        }
+
+        auto action = event_action::next;
+        if constexpr (std::same_as<decltype(handler(event)), void>) {
+            handler(event);
+        } else {
+            action = handler(event);
+        }
+
+        if (action == event_action::stop) {
+            stopped = true;
+            return {};
+        }
+        if (action == event_action::enter &&
+            event.type == wire_type::length_delimited) {
+            if (auto result =
+                    parse_events(input,
+                                 input.position() + event.bytes.size(),
+                                 depth + 1,
+                                 handler,
+                                 stopped);
+                failure(result) || stopped) {
+                return result;
+            }
+            if constexpr (requires { handler.end_message(event); }) {
+                handler.end_message(event);
+            }
+        } else {
+            input.position() += event.bytes.size();
+        }
+    }
+    return {};
 }
+} // namespace detail
 
-constexpr auto in_out(auto &&view, auto &&...option)
+// Parses encoded bytes without a target type, calling handler(event) once
+// per field with a field_event. The handler returns an event_action (or
+// nothing, to continue), sub-messages are parsed only when entered and an
+// optional handler.end_message(event) is called when one ends. Shares the
+// tag and value reading of in and allocates nothing.
+constexpr bits::errc parse_events(auto &&view, auto &&handler)
 {
-    return std::tuple{
-        in<std::remove_reference_t<typename decltype(in{view})::view_type>,
-           decltype(option) &...>(view, option...),
-        out(std::forward<decltype(view)>(view),
-            std::forward<decltype(option)>(option)...)};
+    using byte_type = std::remove_cvref_t<decltype(*std::data(view))>;
+    std::span<const byte_type> data{std::data(view), std::size(view)};
+    in input{data};
+    bool stopped = false;
+    return detail::parse_events(input, data.size(), 0, handler, stopped);
 }
 
-template <typename ByteType = std::byte>
-constexpr auto data_in_out(auto &&...option)
+// Builds a message field by field without a struct, over the same archive
+// as out. Sub-messages are opened with begin_message() and their length is
+// back-filled by end_message(), finish() trims a resizable buffer to the
+// written size.
+template <bits::concepts::byte_view ByteView = std::vector<std::byte>,
+          typename... Options>
+class writer
 {
-    struct data_in_out
+public:
+    constexpr static std::size_t max_depth = 64;
+
+    constexpr explicit writer(ByteView &&view, Options &&...options) :
+        m_out(std::move(view), std::forward<Options>(options)...)
     {
-        data_in_out(decltype(option) &&...option) :
-            input(data, option...),
-            output(data,
-                   std::forward<decltype(option)>(option)...)
-        {
-        }
+    }
 
-        std::vector<ByteType> data;
-        in<decltype(data), decltype(option) &...> input;
-        out<decltype(data), decltype(option)...> output;
-    };
-    return data_in_out{std::forward<decltype(option)>(option)...};
-}
+    constexpr explicit writer(ByteView &view, Options &&...options) :
+        m_out(view, std::forward<Options>(options)...)
+    {
+    }
 
-template <typename ByteType = std::byte>
-constexpr auto data_in(auto &&...option)
-{
-    struct data_in
+    constexpr std::size_t position() const
     {
-        data_in(decltype(option) &&...option) :
-            input(data,
-                  std::forward<decltype(option)>(option)...)
-        {
+        return m_out.position();
+    }
+
+    // Writes an integer, bool or enum as a varint the same way out encodes
+    // a member of that type, pass a vsint32_t/vsint64_t for zig-zag.
+    constexpr bits::errc write_varint(std::uint32_t field, auto value)
+    {
+        using type = decltype(value);
+        if constexpr (bits::concepts::varint<type>) {
+            return m_out.m_archive(make_tag_explicit(wire_type::varint, field),
+                                   value);
+        } else if constexpr (std::is_enum_v<type>) {
+            return write_varint(field, std::underlying_type_t<type>(value));
+        } else if constexpr (std::same_as<type, bool>) {
+            return write_varint(field, unsigned(value));
+        } else {
+            static_assert(std::is_integral_v<type>);
+            return m_out.m_archive(make_tag_explicit(wire_type::varint, field),
+                                   bits::varint{value});
         }
+    }
 
-        std::vector<ByteType> data;
-        in<decltype(data), decltype(option)...> input;
-    };
-    return data_in{std::forward<decltype(option)>(option)...};
-}
+    constexpr bits::errc write_fixed32(std::uint32_t field, auto value)
+    {
+        static_assert(sizeof(value) == sizeof(std::uint32_t));
+        return m_out.m_archive(make_tag_explicit(wire_type::fixed_32, field),
+                               value);
+    }
 
-template <typename ByteType = std::byte>
-constexpr auto data_out(auto &&...option)
-{
-    struct data_out
+    constexpr bits::errc write_fixed64(std::uint32_t field, auto value)
     {
-        data_out(decltype(option) &&...option) :
-            output(data,
-                   std::forward<decltype(option)>(option)...)
-        {
-        }
+        static_assert(sizeof(value) == sizeof(std::uint64_t));
+        return m_out.m_archive(make_tag_explicit(wire_type::fixed_64, field),
+                               value);
+    }
 
-        std::vector<ByteType> data;
-        out<decltype(data), decltype(option)...> output;
-    };
-    return data_out{std::forward<decltype(option)>(option)...};
-}
+    // Writes a string or bytes field from any contiguous range of bytes.
+    constexpr bits::errc write_bytes(std::uint32_t field, const auto &bytes)
+    {
+        std::span data{std::data(bytes), std::size(bytes)};
+        return m_out.m_archive(
+            make_tag_explicit(wire_type::length_delimited, field),
+            bits::varint{data.size()},
+            bits::unsized(data));
+    }
 
-template <auto Object, std::size_t MaxSize = 0x1000>
-constexpr auto to_bytes()
-{
-    constexpr auto size = [] {
-        std::array<std::byte, MaxSize> data;
-        out out{data};
-        out(Object).or_throw();
-        return out.position();
-    }();
+    constexpr bits::errc begin_message(std::uint32_t field)
+    {
+        if (m_depth == max_depth) [[unlikely]] {
+            return std::errc::value_too_large;
+        }
+        if (auto result = m_out.m_archive(
+                make_tag_explicit(wire_type::length_delimited, field));
+            failure(result)) [[unlikely]] {
+            return result;
+        }
+        m_open[m_depth++] = m_out.position();
+        return m_out.m_archive(bits::vsize_t{});
+    }
 
-    if constexpr (!size) {
-        return bits::string_literal<std::byte, 0>{};
-    } else {
-        std::array<std::byte, size> data;
-        out{data}(Object).or_throw();
-        return data;
+    constexpr bits::errc end_message()
+    {
+        if (!m_depth) [[unlikely]] {
+            return std::errc::invalid_argument;
+        }
+        return m_out.write_length(m_open[--m_depth]);
     }
-}
 
-template <auto Data, typename Type>
-constexpr auto from_bytes()
-{
-    Type object;
-    in{Data}(object).or_throw();
-    return object;
-}
+    constexpr bits::errc finish()
+    {
+        if (m_depth) [[unlikely]] {
+            return std::errc::invalid_argument;
+        }
+        if constexpr (decltype(m_out)::resizable) {
+            m_out.m_archive.data().resize(m_out.position());
+        }
+        return {};
+    }
 
+private:
+    out<ByteView, Options...> m_out;
+    std::array<std::size_t, max_depth> m_open{};
+    std::size_t m_depth = 0;
+};
 
 } // namespace proto
 } // namespace zpp